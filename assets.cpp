@@ -0,0 +1,177 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "latexwiki.h"
+
+static const char *assetDir = "out/assets";
+static const unsigned char pngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+ImageAsset::ImageAsset()
+: found(false), hash(0), width(0), height(0), size(0), modified(0)
+{ }
+
+static unsigned readBigEndian(const char *data) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+    return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+// Read the size of a PNG from its IHDR chunk, which must come first.
+static bool readPngSize(const char *data, std::size_t size, unsigned &width, unsigned &height) {
+    if (size < 24 || std::memcmp(data, pngSignature, sizeof(pngSignature)) != 0) return false;
+    if (readBigEndian(data + 8) != 13 || std::memcmp(data + 12, "IHDR", 4) != 0) return false;
+    width = readBigEndian(data + 16);
+    height = readBigEndian(data + 20);
+    return width != 0 && height != 0;
+}
+
+// The name of an image's copy: the name of its file, without directories or
+// extension, and the hash of its content.
+static std::string outputName(const std::string &source, unsigned long long hash) {
+    std::string::size_type slash = source.rfind('/');
+    std::string base = slash == std::string::npos ? source : source.substr(slash + 1);
+    std::string::size_type dot = base.rfind('.');
+    if (dot != std::string::npos && dot > 0) base.erase(dot);
+    char hex[24];
+    std::snprintf(hex, sizeof(hex), ".%016llx.png", hash);
+    return "assets/" + base + hex;
+}
+
+// Copy an image into place under a temporary name and rename it, so a
+// partial copy is never taken for a finished one. Returns false on failure.
+static bool copyImage(const SourceFile *file, const std::string &path) {
+    static std::atomic<unsigned> nextTemp(0);
+    std::stringstream tempPath;
+    tempPath << path << ".tmp." << getpid() << '.' << nextTemp++;
+    {
+        std::ofstream out(tempPath.str(), std::ios::binary);
+        if (!out) return false;
+        out.write(file->data, file->size);
+        if (!out) {
+            out.close();
+            std::remove(tempPath.str().c_str());
+            return false;
+        }
+    }
+    if (std::rename(tempPath.str().c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+// Find, measure and hash one image. What the last build found is reused if
+// the file has the same size and modification time and its copy exists.
+static void prepareImage(ImageAsset &image, const ImageAsset *last, bool copy) {
+    TraceSpan span("io", "image", image.source);
+    struct stat info;
+    if (stat(image.source.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        image.problem = "Image file " + image.source + " not found; looked for it in out/ as well.";
+        return;
+    }
+    image.size = info.st_size;
+    image.modified = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+    if (last && last->found && last->size == image.size && last->modified == image.modified
+            && (!copy || fileExists("out/" + last->output))) {
+        image.found = true;
+        image.hash = last->hash;
+        image.width = last->width;
+        image.height = last->height;
+        image.output = last->output;
+        return;
+    }
+
+    SourceFile *file = SourceFile::open(image.source);
+    if (!file) {
+        image.problem = "Failed to read image file " + image.source + ".";
+        return;
+    }
+    if (!readPngSize(file->data, file->size, image.width, image.height)) {
+        image.problem = "Image file " + image.source + " is not a PNG file.";
+    } else {
+        image.hash = hashBytes(file->data, file->size);
+        image.output = outputName(image.source, image.hash);
+        if (copy && !fileExists("out/" + image.output) && !copyImage(file, "out/" + image.output)) {
+            image.problem = "Failed to copy image file " + image.source + " to out/" + image.output + ".";
+        } else {
+            image.found = true;
+        }
+    }
+    delete file;
+}
+
+// Gather the images every article shows and prepare them in parallel: each is
+// looked for in the document's graphics path, measured from its PNG header
+// and, if copy is set, copied into out/assets under a name including its
+// hash. Copies no article uses any more are removed. An image that cannot be
+// used is an error for each article showing it.
+void prepareImages(Document &document, const BuildManifest *previous, bool copy, ErrorLog &errorLog) {
+    TraceSpan span("phase", "images");
+    document.images.clear();
+    for (const Article *article : document.articles) {
+        for (const std::string &name : article->images) {
+            ImageAsset &image = document.images[name];
+            if (!image.source.empty()) continue;
+            // Pages used to link to images next to themselves, so projects
+            // from before out/assets keep their images in out/.
+            const std::string path = document.graphicsPath + name + ".png";
+            image.source = fileExists(path) || !fileExists("out/" + path) ? path : "out/" + path;
+        }
+    }
+
+    std::vector<ImageAsset*> images;
+    std::vector<const ImageAsset*> last;
+    for (auto &iter : document.images) {
+        images.push_back(&iter.second);
+        auto old = previous ? previous->images.find(iter.first) : std::map<std::string, ImageAsset>::const_iterator();
+        last.push_back(previous && old != previous->images.end() && old->second.source == iter.second.source ? &old->second : nullptr);
+    }
+    if (copy && !images.empty()) {
+        mkdir("out", 0755);
+        mkdir(assetDir, 0755);
+    }
+    runParallel(images.size(), jobCount, [&](unsigned i) {
+        prepareImage(*images[i], last[i], copy);
+    });
+
+    for (const Article *article : document.articles) {
+        std::set<std::string> reported;
+        for (const std::string &name : article->images) {
+            const ImageAsset &image = document.images[name];
+            if (!image.found && reported.insert(name).second) {
+                errorLog.add(ErrorType::Error, article->sourceFile, image.problem);
+            }
+        }
+    }
+
+    if (!copy) return;
+    std::set<std::string> current;
+    for (const auto &iter : document.images) {
+        if (iter.second.found) current.insert(iter.second.output.substr(std::strlen("assets/")));
+    }
+    DIR *dir = opendir(assetDir);
+    if (!dir) return;
+    while (struct dirent *entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name == "." || name == ".." || current.count(name) != 0) continue;
+        std::remove((assetDir + ("/" + name)).c_str());
+    }
+    closedir(dir);
+}
+
+// The image whose copy has the given name under out/, if any.
+const ImageAsset* findImageAsset(const Document &document, const std::string &output) {
+    for (const auto &iter : document.images) {
+        if (iter.second.found && iter.second.output == output) return &iter.second;
+    }
+    return nullptr;
+}
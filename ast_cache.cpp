@@ -0,0 +1,246 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "latexwiki.h"
+
+bool useAstCache = true;
+
+static const char *astCacheDir = "out/.astcache";
+static const char astCacheMagic[8] = { 'L', 'W', 'A', 'S', 'T', '\r', '\n', '\0' };
+// Bump whenever the layout below changes.
+static const std::uint32_t astCacheFormat = 2;
+
+// A cache file is this header followed by the nodes of the article exactly
+// as they are held in memory and the messages the parser reported for it.
+// The text the nodes refer to is not copied: it is read from the source
+// file, after checking that its size and hash are the ones recorded here.
+// Everything is in native byte order; the cache is never shared between
+// machines.
+struct AstCacheHeader {
+    char magic[8];
+    std::uint32_t format;
+    std::uint32_t parser;
+    std::uint64_t commandTable;
+    std::uint64_t sourceHash;
+    std::uint64_t sourceSize;
+    std::uint32_t nodeCount;
+    std::uint32_t messageCount;
+    std::uint64_t messagesSize;
+};
+
+static_assert(sizeof(Node) == 16, "nodes must stay packed");
+static_assert(sizeof(AstCacheHeader) % alignof(Node) == 0, "cached nodes must stay aligned");
+
+// Cached trees store command IDs, so any change to the names or argument
+// counts of the command table makes them stale.
+static unsigned long long hashCommandTable() {
+    unsigned long long hash = HASH_SEED;
+    for (unsigned i = 0; i < static_cast<unsigned>(CommandId::Count); ++i) {
+        const CommandInfo &info = commandInfo[i];
+        std::stringstream entry;
+        entry << info.name << ' ' << info.minArgs << ' ' << info.maxArgs << '\n';
+        hash = hashText(entry.str(), hash);
+    }
+    return hash;
+}
+static const unsigned long long commandTableHash = hashCommandTable();
+
+static std::string cachePath(unsigned long long sourceHash) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.ast", sourceHash);
+    return astCacheDir + std::string(name);
+}
+
+
+// Save a freshly parsed article under the hash of its source text, along
+// with the messages from errorLog.errors[firstMessage] on, which are the ones
+// the parser reported. sourceHashed says the article's sourceHash was taken
+// from its source as it is now. Failing to save only costs a parse next time,
+// so it is not reported.
+void saveCachedArticle(const Article *article, const ErrorLog &errorLog, std::size_t firstMessage, bool sourceHashed) {
+    const SourceFile *source = article->source;
+    const SyntaxTree &tree = article->tree;
+    if (!source || tree.textBase != source->data) return;
+    TraceSpan span("io", "save ast cache", article->sourceFile);
+
+    std::string messages;
+    for (std::size_t i = firstMessage; i < errorLog.errors.size(); ++i) {
+        const ErrorMsg &msg = errorLog.errors[i];
+        std::uint8_t type = static_cast<std::uint8_t>(msg.type);
+        std::uint32_t size = msg.message.size();
+        messages.append(reinterpret_cast<const char*>(&type), sizeof(type));
+        messages.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        messages += msg.message;
+    }
+
+    AstCacheHeader header;
+    std::memcpy(header.magic, astCacheMagic, sizeof(header.magic));
+    header.format = astCacheFormat;
+    header.parser = parserVersion;
+    header.commandTable = commandTableHash;
+    header.sourceHash = sourceHashed ? article->sourceHash : hashBytes(source->data, source->size);
+    header.sourceSize = source->size;
+    header.nodeCount = tree.count;
+    header.messageCount = errorLog.errors.size() - firstMessage;
+    header.messagesSize = messages.size();
+
+    // Written under a temporary name and renamed into place, so a reader
+    // never sees a partial file even if two workers save the same text.
+    static std::atomic<unsigned> nextTemp(0);
+    mkdir(astCacheDir, 0755);
+    const std::string path = cachePath(header.sourceHash);
+    std::stringstream tempPath;
+    tempPath << path << ".tmp." << getpid() << '.' << nextTemp++;
+    {
+        std::ofstream out(tempPath.str(), std::ios::binary);
+        if (!out) return;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(tree.nodes), tree.count * sizeof(Node));
+        out.write(messages.data(), messages.size());
+        if (!out) {
+            out.close();
+            std::remove(tempPath.str().c_str());
+            return;
+        }
+    }
+    if (std::rename(tempPath.str().c_str(), path.c_str()) != 0) std::remove(tempPath.str().c_str());
+}
+
+// Map the node tree of an article from the cache entry for its source hash;
+// source is the article's source file, which the nodes' text lies in. The
+// nodes are used where they lie in the mapping. Nothing in the file is
+// trusted: an entry that is stale, truncated, malformed, nested deeper than
+// -maxdepth allows or for other text is ignored and the source is parsed
+// instead. The source is only hashed again if sourceHashed is false, that is
+// unless the article's sourceHash was just taken from the same mapping. On
+// success the article takes over source.
+bool loadCachedArticle(Article *article, SourceFile *source, bool sourceHashed, ErrorLog &errorLog) {
+    TraceSpan span("io", "load ast cache", article->sourceFile);
+    SourceFile *cache = SourceFile::open(cachePath(article->sourceHash));
+    if (!cache) return false;
+
+    AstCacheHeader header;
+    if (cache->size < sizeof(header)) {
+        delete cache;
+        return false;
+    }
+    std::memcpy(&header, cache->data, sizeof(header));
+    const std::uint64_t nodesSize = static_cast<std::uint64_t>(header.nodeCount) * sizeof(Node);
+    if (std::memcmp(header.magic, astCacheMagic, sizeof(header.magic)) != 0
+            || header.format != astCacheFormat || header.parser != parserVersion
+            || header.commandTable != commandTableHash || header.sourceHash != article->sourceHash
+            || header.sourceSize != source->size
+            || header.messagesSize > cache->size
+            || sizeof(header) + nodesSize + header.messagesSize != cache->size
+            || (!sourceHashed && hashBytes(source->data, source->size) != header.sourceHash)) {
+        delete cache;
+        return false;
+    }
+    const Node *nodes = reinterpret_cast<const Node*>(cache->data + sizeof(header));
+    const char *messages = cache->data + sizeof(header) + nodesSize;
+
+    // Check that every node lies inside its parent and refers to text inside
+    // the source, so walking the tree cannot go astray, and that arguments
+    // are nested no deeper than the parser allows, since rendering recurses
+    // once for each.
+    std::vector<std::uint32_t> ends;
+    std::vector<char> isArgument;
+    unsigned arguments = 0;
+    bool valid = true;
+    for (std::uint32_t i = 0; valid && i < header.nodeCount; ++i) {
+        const Node &node = nodes[i];
+        while (!ends.empty() && i >= ends.back()) {
+            arguments -= isArgument.back();
+            ends.pop_back();
+            isArgument.pop_back();
+        }
+        const std::uint32_t limit = ends.empty() ? header.nodeCount : ends.back();
+        const bool topLevel = ends.empty();
+        if (node.next <= i || node.next > limit
+                || static_cast<std::uint64_t>(node.textStart) + node.textSize > header.sourceSize) {
+            valid = false;
+            break;
+        }
+        switch (node.kind) {
+        case NodeKind::Paragraph:
+            valid = topLevel;
+            break;
+        case NodeKind::Fragment:
+            valid = !topLevel && ++arguments <= maxNesting;
+            break;
+        case NodeKind::Command:
+            valid = !topLevel && node.id < CommandId::Count;
+            break;
+        case NodeKind::Text:
+        case NodeKind::EscapedText:
+            valid = !topLevel && node.next == i + 1;
+            break;
+        default:
+            valid = false;
+        }
+        ends.push_back(node.next);
+        isArgument.push_back(node.kind == NodeKind::Fragment);
+    }
+
+    std::vector<ErrorMsg> parseMessages;
+    const char *pos = messages, *end = messages + header.messagesSize;
+    for (std::uint32_t i = 0; valid && i < header.messageCount; ++i) {
+        std::uint8_t type;
+        std::uint32_t size;
+        if (end - pos < static_cast<std::ptrdiff_t>(sizeof(type) + sizeof(size))) {
+            valid = false;
+            break;
+        }
+        std::memcpy(&type, pos, sizeof(type));
+        std::memcpy(&size, pos + sizeof(type), sizeof(size));
+        pos += sizeof(type) + sizeof(size);
+        if (type > static_cast<std::uint8_t>(ErrorType::Fatal) || static_cast<std::uint64_t>(end - pos) < size) {
+            valid = false;
+            break;
+        }
+        parseMessages.push_back(ErrorMsg{static_cast<ErrorType>(type), article->sourceFile, std::string(pos, size)});
+        pos += size;
+    }
+    if (!valid || pos != end) {
+        delete cache;
+        return false;
+    }
+
+    for (const ErrorMsg &msg : parseMessages) errorLog.add(msg.type, msg.sourceFile, msg.message);
+    delete article->source;
+    article->source = source;
+    delete article->cachedTree;
+    article->cachedTree = cache;
+    article->tree.setNodes(nodes, header.nodeCount, source->data);
+    article->sourceSize = source->size;
+    article->isLoaded = true;
+    return true;
+}
+
+// Remove cache entries for source text that no article of the document has
+// any more.
+void pruneAstCache(const Document &document) {
+    std::set<std::string> current;
+    for (const Article *article : document.articles) {
+        current.insert(cachePath(article->sourceHash).substr(std::strlen(astCacheDir) + 1));
+    }
+    DIR *dir = opendir(astCacheDir);
+    if (!dir) return;
+    while (struct dirent *entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name == "." || name == ".." || current.count(name) != 0) continue;
+        std::remove((astCacheDir + ("/" + name)).c_str());
+    }
+    closedir(dir);
+}
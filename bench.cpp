@@ -0,0 +1,428 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "latexwiki.h"
+
+bool showMissingWorld = false;
+bool showMissingCategory = false;
+bool showOrphans = false;
+bool hideWarnings = true;
+bool fullRebuild = true;
+bool useUring = true;
+
+// The shape of a generated corpus.
+struct CorpusOptions {
+    CorpusOptions();
+
+    unsigned articles;
+    unsigned words;         // words of text in each article
+    double linkDensity;     // chance of each word being a \pageref
+    unsigned worlds;
+    unsigned categories;
+    unsigned depth;         // deepest nesting of commands inside arguments
+    unsigned seed;
+};
+
+CorpusOptions::CorpusOptions()
+: articles(1000), words(2000), linkDensity(0.02), worlds(8), categories(12), depth(3), seed(1)
+{ }
+
+struct BenchResult {
+    std::string name;
+    unsigned threads;
+    double seconds;
+};
+
+// Writes a wiki project of made-up articles. Markup is drawn from the real
+// command table, so every command the formatter knows how to render shows up.
+struct CorpusGenerator {
+    CorpusGenerator(const CorpusOptions &options);
+    void write();
+    void writeArticle(unsigned index, std::ostream &out);
+    void writeCommand(std::ostream &out, unsigned depth, unsigned &words);
+    void writeWord(std::ostream &out, unsigned depth, unsigned &words);
+    void writeImage(const std::string &filename, unsigned width, unsigned height);
+
+    const CorpusOptions &options;
+    std::mt19937 random;
+    std::vector<CommandId> markup;
+    unsigned nextLabel;
+    std::size_t totalBytes;
+    std::vector<std::string> sources;
+};
+
+static const char *vocabulary[] = {
+    "the", "of", "nexus", "world", "gate", "a", "ship", "river", "ancient", "and",
+    "city", "``quoted''", "--", "---", "station", "empire", "north", "in", "to", "stars"
+};
+
+CorpusGenerator::CorpusGenerator(const CorpusOptions &options)
+: options(options), random(options.seed), nextLabel(0), totalBytes(0)
+{
+    // commands with a fixed HTML format can be nested anywhere; the ones
+    // handled by custom code are written deliberately below
+    for (unsigned i = 1; i < static_cast<unsigned>(CommandId::Count); ++i) {
+        const CommandInfo &info = getCommandInfo(static_cast<CommandId>(i));
+        if (info.format && info.format[0] && info.minArgs == info.maxArgs) {
+            markup.push_back(static_cast<CommandId>(i));
+        }
+    }
+}
+
+void CorpusGenerator::write() {
+    mkdir("src", 0755);
+    mkdir("out", 0755);
+    mkdir("templates", 0755);
+
+    std::ofstream front("templates/front.html");
+    front << "<!DOCTYPE html>\n<html>\n<head>\n<title>%TITLE%</title>\n</head>\n<body>\n";
+    front << "<div class='navlist'>%WORLDNAV%</div>\n<div class='navlist'>%CATNAV%</div>\n";
+    std::ofstream back("templates/back.html");
+    back << "<div id='footer'>Generated on %GENTIME%.</div>\n</body>\n</html>\n";
+
+    // One image sits in the project and one in out/, where projects from
+    // before out/assets keep theirs; the pipeline fails if either is missed.
+    writeImage("figure.png", 640, 480);
+    writeImage("out/old-figure.png", 320, 240);
+
+    std::ofstream files("files.lst");
+    for (unsigned i = 0; i < options.articles; ++i) {
+        std::stringstream name;
+        name << "src/art" << i << ".tex";
+        std::ostringstream text;
+        writeArticle(i, text);
+        std::ofstream source(name.str());
+        source << text.str();
+        totalBytes += text.str().size();
+        files << name.str() << '\n';
+        sources.push_back(name.str());
+    }
+}
+
+void CorpusGenerator::writeArticle(unsigned index, std::ostream &out) {
+    out << "\\pageinfo{Article " << index << "}{page" << index << "}";
+    out << "{World " << random() % options.worlds << "}";
+    out << "{Category " << random() % options.categories << "}\n\n";
+    if (index % 10 == 0) {
+        out << "\\narrowimage{" << (index % 20 == 0 ? "figure" : "old-figure") << "}{Figure " << index << "}\n\n";
+    }
+
+    unsigned words = 0;
+    unsigned paragraphWords = 0;
+    while (words < options.words) {
+        if (paragraphWords == 0 && random() % 4 == 0) {
+            out << "\\section{Section " << words << "}\n";
+            out << "\\addlabel{Section " << nextLabel << "}{section" << nextLabel << "}\n";
+            ++nextLabel;
+        }
+        writeWord(out, 0, words);
+        out << (random() % 12 == 0 ? '\n' : ' ');
+        if (++paragraphWords > 60 + random() % 60) {
+            out << "\n\n";
+            paragraphWords = 0;
+        }
+    }
+    if (random() % 4 == 0) {
+        out << "\n\n\\begin{itemize}\n";
+        for (unsigned i = 0; i < 4; ++i) out << "\\item " << vocabulary[random() % 20] << "\n";
+        out << "\\end{itemize}\n";
+    }
+    out << '\n';
+}
+
+void CorpusGenerator::writeWord(std::ostream &out, unsigned depth, unsigned &words) {
+    ++words;
+    if (std::generate_canonical<double, 32>(random) < options.linkDensity) {
+        out << "\\pageref{page" << random() % options.articles << "}";
+    } else if (depth < options.depth && random() % 16 == 0) {
+        writeCommand(out, depth + 1, words);
+    } else {
+        out << vocabulary[random() % 20];
+    }
+}
+
+void CorpusGenerator::writeCommand(std::ostream &out, unsigned depth, unsigned &words) {
+    const CommandId id = markup[random() % markup.size()];
+    const CommandInfo &info = getCommandInfo(id);
+    out << '\\' << info.name;
+    for (int arg = 0; arg < info.minArgs; ++arg) {
+        out << '{';
+        unsigned count = 1 + random() % 4;
+        for (unsigned i = 0; i < count; ++i) {
+            if (i > 0) out << ' ';
+            writeWord(out, depth, words);
+        }
+        out << '}';
+    }
+}
+
+// Only the signature and IHDR chunk are written, which is all the build
+// reads.
+void CorpusGenerator::writeImage(const std::string &filename, unsigned width, unsigned height) {
+    std::ofstream out(filename, std::ios::binary);
+    out.write("\x89PNG\r\n\x1a\n", 8);
+    const unsigned char header[] = {
+        0, 0, 0, 13, 'I', 'H', 'D', 'R',
+        static_cast<unsigned char>(width >> 24), static_cast<unsigned char>(width >> 16),
+        static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width),
+        static_cast<unsigned char>(height >> 24), static_cast<unsigned char>(height >> 16),
+        static_cast<unsigned char>(height >> 8), static_cast<unsigned char>(height),
+        8, 2, 0, 0, 0
+    };
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+}
+
+
+// Discards the pages it is given.
+struct NullOutput : public PageOutput {
+    virtual void submit(const std::string &filename, std::string &&content) override { }
+};
+
+static double elapsed(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Run work repeatedly, calling setup untimed before each run, and return the
+// median time taken.
+static double timeRuns(unsigned repetitions, const std::function<void()> &setup, const std::function<void()> &work) {
+    std::vector<double> times;
+    for (unsigned i = 0; i < repetitions; ++i) {
+        if (setup) setup();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        work();
+        times.push_back(elapsed(start));
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static void freeArticles(std::vector<Article*> &articles) {
+    for (Article *article : articles) delete article;
+    articles.assign(articles.size(), nullptr);
+}
+
+static std::vector<unsigned> parseThreadList(const std::string &text) {
+    std::vector<unsigned> threads;
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        int count = std::atoi(item.c_str());
+        if (count > 0) threads.push_back(count);
+    }
+    return threads;
+}
+
+static std::vector<unsigned> defaultThreads() {
+    unsigned hardware = std::thread::hardware_concurrency();
+    if (hardware < 1) hardware = 1;
+    std::vector<unsigned> threads;
+    for (unsigned count = 1; count < hardware; count *= 2) threads.push_back(count);
+    threads.push_back(hardware);
+    return threads;
+}
+
+static void usage() {
+    std::cerr << "USAGE: latexwiki_bench [options] [work directory]\n\n";
+    std::cerr << "-articles N     Number of articles to generate (1000)\n";
+    std::cerr << "-words N        Words of text in each article (2000)\n";
+    std::cerr << "-links F        Chance of each word being a page reference (0.02)\n";
+    std::cerr << "-worlds N       Number of worlds (8)\n";
+    std::cerr << "-categories N   Number of categories (12)\n";
+    std::cerr << "-depth N        Deepest nesting of commands (3)\n";
+    std::cerr << "-seed N         Random seed for the corpus (1)\n";
+    std::cerr << "-threads LIST   Comma separated thread counts to measure (1,2,4,... up to the core count)\n";
+    std::cerr << "-reps N         Runs of each benchmark; the median is reported (5)\n";
+}
+
+int main(int argc, const char **argv) {
+    CorpusOptions options;
+    std::vector<unsigned> threadCounts = defaultThreads();
+    unsigned repetitions = 5;
+    std::string directory;
+    // every run should measure parsing, not reading trees cached by the last
+    useAstCache = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-help") {
+            usage();
+            return 0;
+        } else if (arg[0] == '-') {
+            if (i + 1 >= argc) {
+                std::cerr << arg << " requires a value.\n";
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "-articles") options.articles = std::atoi(value.c_str());
+            else if (arg == "-words") options.words = std::atoi(value.c_str());
+            else if (arg == "-links") options.linkDensity = std::atof(value.c_str());
+            else if (arg == "-worlds") options.worlds = std::atoi(value.c_str());
+            else if (arg == "-categories") options.categories = std::atoi(value.c_str());
+            else if (arg == "-depth") options.depth = std::atoi(value.c_str());
+            else if (arg == "-seed") options.seed = std::atoi(value.c_str());
+            else if (arg == "-threads") threadCounts = parseThreadList(value);
+            else if (arg == "-reps") repetitions = std::atoi(value.c_str());
+            else {
+                std::cerr << "Unrecognized argument " << arg << "; run \"latexwiki_bench -help\" for instructions.\n";
+                return 1;
+            }
+        } else {
+            directory = arg;
+        }
+    }
+    if (options.articles < 1 || options.worlds < 1 || options.categories < 1
+            || repetitions < 1 || threadCounts.empty()) {
+        std::cerr << "Article, world, category, repetition and thread counts must be positive.\n";
+        return 1;
+    }
+
+    if (directory.empty()) {
+        char name[] = "/tmp/latexwiki_bench.XXXXXX";
+        if (!mkdtemp(name)) {
+            std::cerr << "Failed to create a work directory.\n";
+            return 1;
+        }
+        directory = name;
+    } else {
+        mkdir(directory.c_str(), 0755);
+    }
+    if (chdir(directory.c_str()) != 0) {
+        std::cerr << "Failed to enter work directory " << directory << ".\n";
+        return 1;
+    }
+
+    std::cerr << "Generating corpus in " << directory << "...\n";
+    CorpusGenerator generator(options);
+    generator.write();
+    const std::vector<std::string> &sources = generator.sources;
+
+    // the build prints its progress; keep it out of the way of the results
+    std::ofstream nowhere;
+    std::streambuf *stderrBuffer = std::cerr.rdbuf();
+
+    std::vector<BenchResult> results;
+    std::vector<Article*> articles(sources.size(), nullptr);
+    for (unsigned threads : threadCounts) {
+        std::cerr << "processFile, " << threads << " threads...\n";
+        double seconds = timeRuns(repetitions, [&]() { freeArticles(articles); }, [&]() {
+            runParallel(sources.size(), threads, [&](unsigned i) {
+                ErrorLog errorLog;
+                articles[i] = processFile(sources[i], errorLog);
+            });
+        });
+        results.push_back(BenchResult{"processFile", threads, seconds});
+    }
+
+    Document document;
+    std::cerr << "ScanDocument...\n";
+    double scanSeconds = timeRuns(repetitions, [&]() {
+        document = Document();
+        for (Article *article : articles) {
+            article->labels.clear();
+            article->references.clear();
+            article->hasPageInfo = false;
+        }
+    }, [&]() {
+        ScanDocument scanner(&document);
+        ErrorLog errorLog;
+        scanner.errorLog = &errorLog;
+        for (Article *article : articles) {
+            scanner.article = article;
+            article->process(scanner);
+            document.addArticle(article);
+        }
+        document.resolveLinks();
+    });
+    results.push_back(BenchResult{"ScanDocument", 1, scanSeconds});
+
+    for (unsigned threads : threadCounts) {
+        std::cerr << "FormatDocument, " << threads << " threads...\n";
+        double seconds = timeRuns(repetitions, nullptr, [&]() {
+            runParallel(articles.size(), threads, [&](unsigned i) {
+                std::ostringstream page;
+                ErrorLog errorLog;
+                FormatDocument formatter(&document, page);
+                formatter.errorLog = &errorLog;
+                formatter.article = articles[i];
+                articles[i]->process(formatter);
+            });
+        });
+        results.push_back(BenchResult{"FormatDocument", threads, seconds});
+    }
+
+    std::cerr << "make_indexes...\n";
+    PageTemplate front, back;
+    const std::string frontText = readFile("templates/front.html");
+    const std::string backText = readFile("templates/back.html");
+    front.parse(frontText);
+    back.parse(backText);
+    double indexSeconds = timeRuns(repetitions, nullptr, [&]() {
+        NullOutput output;
+        make_indexes(front, back, "today", document, output);
+    });
+    results.push_back(BenchResult{"make_indexes", 1, indexSeconds});
+    freeArticles(articles);
+
+    for (unsigned threads : threadCounts) {
+        std::cerr << "Full pipeline, " << threads << " threads...\n";
+        jobCount = threads;
+        std::cerr.rdbuf(nowhere.rdbuf());
+        int status = 0;
+        double seconds = timeRuns(repetitions, nullptr, [&]() {
+            Builder builder("files.lst");
+            builder.loadProject();
+            builder.loadTemplates();
+            if (builder.build() != 0) status = 1;
+        });
+        std::cerr.rdbuf(stderrBuffer);
+        std::cerr.clear();
+        if (status != 0) {
+            std::cerr << "The build of the corpus failed; run latexwiki in " << directory << " for its errors.\n";
+            return 1;
+        }
+        results.push_back(BenchResult{"pipeline", threads, seconds});
+    }
+
+    const double megabytes = generator.totalBytes / 1000000.0;
+    std::cout << "{\n";
+    std::cout << "  \"corpus\": {\n";
+    std::cout << "    \"articles\": " << options.articles << ",\n";
+    std::cout << "    \"bytes\": " << generator.totalBytes << ",\n";
+    std::cout << "    \"wordsPerArticle\": " << options.words << ",\n";
+    std::cout << "    \"linkDensity\": " << options.linkDensity << ",\n";
+    std::cout << "    \"worlds\": " << options.worlds << ",\n";
+    std::cout << "    \"categories\": " << options.categories << ",\n";
+    std::cout << "    \"depth\": " << options.depth << ",\n";
+    std::cout << "    \"seed\": " << options.seed << "\n";
+    std::cout << "  },\n";
+    std::cout << "  \"repetitions\": " << repetitions << ",\n";
+    std::cout << "  \"results\": [\n";
+    for (unsigned i = 0; i < results.size(); ++i) {
+        const BenchResult &result = results[i];
+        std::cout << "    { \"phase\": \"" << result.name << "\", \"threads\": " << result.threads;
+        std::cout << ", \"seconds\": " << result.seconds;
+        std::cout << ", \"mbPerSecond\": " << megabytes / result.seconds;
+        std::cout << ", \"articlesPerSecond\": " << options.articles / result.seconds;
+        // speedup is against the same phase's run at the first thread count
+        unsigned first = i;
+        while (first > 0 && results[first - 1].name == result.name) --first;
+        std::cout << ", \"speedup\": " << results[first].seconds / result.seconds << " }";
+        std::cout << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    std::cout << "  ]\n";
+    std::cout << "}\n";
+    return 0;
+}
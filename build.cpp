@@ -0,0 +1,920 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "latexwiki.h"
+
+static const char *manifestFile = "out/.manifest";
+// Number of slowest articles listed by -stats.
+static const unsigned statsCount = 10;
+
+void dumpErrors(const ErrorLog &errorLog, bool hideWarnings) {
+    for (const ErrorMsg &msg : errorLog.errors) {
+        if (hideWarnings && msg.type == ErrorType::Warning) continue;
+        switch (msg.type) {
+            case ErrorType::Fatal:      std::cerr << "FATAL  "; break;
+            case ErrorType::Error:      std::cerr << "ERROR  "; break;
+            case ErrorType::Warning:    std::cerr << "WARN   "; break;
+        }
+        std::cerr << msg.sourceFile << ": " << msg.message << "\n";
+    }
+    std::cerr << "Warnings: " << errorLog.warnCount << "; errors: " << errorLog.errorCount << "; fatals: " << errorLog.fatalCount << ".\n";
+}
+
+
+std::string makeNavBar(const NavPosition &position, const std::string &navName, const std::string &navCurrent, const Article *current) {
+    std::stringstream worldListString;
+    if (position.listed) {
+        worldListString << navName << ": <span class='navtype'>" << navCurrent << "</span> ";
+        if (position.prev) {
+            const Article *prev = position.prev;
+            worldListString << "&lt;&lt; <a href='";
+            worldListString << prev->filename;
+            worldListString << "'>";
+            worldListString << prev->name;
+            worldListString << "</a> | ";
+        }
+        worldListString << current->name;
+        if (position.next) {
+            const Article *prev = position.next;
+            worldListString << " | <a href='";
+            worldListString << prev->filename;
+            worldListString << "'>";
+            worldListString << prev->name;
+            worldListString << "</a> &gt;&gt;";
+        }
+    }
+    return worldListString.str();
+}
+
+
+// Record each article's neighbours in its world and category and render its
+// nav bars, once per scan. An article listed more than once keeps its first
+// position.
+static void placeArticles(const std::map<std::string, std::vector<Article*>> &lists, NavPosition Article::*position) {
+    for (const auto &iter : lists) {
+        const std::vector<Article*> &list = iter.second;
+        for (unsigned i = 0; i < list.size(); ++i) {
+            NavPosition &place = list[i]->*position;
+            if (place.listed) continue;
+            place.listed = true;
+            place.index = i;
+            place.prev = i > 0 ? list[i - 1] : nullptr;
+            place.next = i + 1 < list.size() ? list[i + 1] : nullptr;
+        }
+    }
+}
+
+void buildNavigation(Document &document) {
+    for (Article *article : document.articles) {
+        article->worldPos = NavPosition();
+        article->categoryPos = NavPosition();
+    }
+    placeArticles(document.worlds, &Article::worldPos);
+    placeArticles(document.categories, &Article::categoryPos);
+    for (Article *article : document.articles) {
+        article->catNav.clear();
+        article->worldNav.clear();
+        if (!article->category.empty()) article->catNav = makeNavBar(article->categoryPos, "Category", article->category, article);
+        if (!article->world.empty()) article->worldNav = makeNavBar(article->worldPos, "World", article->world, article);
+    }
+}
+
+void makePageFields(const Article *article, PageFields &fields) {
+    fields.title = article->name;
+    fields.catNav = article->catNav;
+    fields.worldNav = article->worldNav;
+}
+
+// The "Referenced by" block closing an article's page, linking to where in
+// each other article it is referred to.
+void writeBacklinks(std::ostream &out, const Article *article) {
+    if (article->referencedBy.empty()) return;
+    out << "<div class='backlinks'><h2>Referenced by</h2>\n<ul>\n";
+    for (const Backlink &backlink : article->referencedBy) {
+        out << "<li><a href='" << backlink.from->filename;
+        if (!backlink.reference->anchor.empty()) out << '#' << backlink.reference->anchor;
+        out << "'>" << backlink.from->name << "</a></li>\n";
+    }
+    out << "</ul></div>\n";
+}
+
+// List the articles no other article refers to.
+void reportOrphans(const Document &document) {
+    std::vector<std::string> orphans;
+    for (const Article *article : document.articles) {
+        if (article->referencedBy.empty()) orphans.push_back(article->name.empty() ? article->sourceFile : article->name);
+    }
+    if (orphans.empty()) return;
+    std::cerr << "Articles not referenced by any other article:\n";
+    for (const std::string &name : orphans) {
+        std::cerr << "    " << name << '\n';
+    }
+}
+
+// Delete the pages of articles that were in the last build but no longer are,
+// along with their compressed copies.
+void removeStaleOutput(const BuildManifest &previous, const Document &document, BuildManifest &current) {
+    std::set<std::string> written;
+    for (const Article *article : document.articles) written.insert(article->filename);
+    for (const auto &iter : previous.entries) {
+        if (written.count(iter.second.filename) == 0) {
+            const std::string page = "out/" + iter.second.filename;
+            std::remove(page.c_str());
+            removeCompressedCopies(page);
+            current.compressed.erase(page);
+            removeSearchTerms(iter.second.filename);
+        }
+    }
+}
+
+// Mark the articles showing an image whose copy differs from the last build's.
+static void markChangedImages(const Document &document, const BuildManifest &previous, std::vector<char> &stale) {
+    std::set<std::string> changed;
+    for (const auto &iter : document.images) {
+        const ImageAsset &image = iter.second;
+        auto old = previous.images.find(iter.first);
+        if (old == previous.images.end() || old->second.found != image.found || old->second.output != image.output
+                || old->second.width != image.width || old->second.height != image.height) {
+            changed.insert(iter.first);
+        }
+    }
+    if (changed.empty()) return;
+    for (unsigned i = 0; i < document.articles.size(); ++i) {
+        for (const std::string &name : document.articles[i]->images) {
+            if (changed.count(name) != 0) stale[i] = true;
+        }
+    }
+}
+
+// Whether -compress is on but the last build left the file without compressed
+// copies, as when it was run without -compress.
+static bool lacksCompressedCopies(const BuildManifest &previous, const std::string &filename) {
+    return compressOutput && previous.compressed.count(filename) == 0;
+}
+
+
+Builder::Builder(const std::string &filelist)
+: filelist(filelist), havePrevious(false), keepResident(false), lowMemory(false), searchIndex(true), showStats(false), changesKnown(false),
+  documentCurrent(false), manifestPending(false), linksChanged(false), indexInputsChanged(false), parseCount(0)
+{
+    if (!fullRebuild) havePrevious = previous.load(manifestFile);
+}
+
+Builder::~Builder() {
+    for (auto &iter : resident) delete iter.second;
+}
+
+bool Builder::loadProject() {
+    std::ifstream files(filelist);
+    if (!files) {
+        std::cerr << "Failed to open project file " << filelist << ".\n";
+        return false;
+    }
+    sources.clear();
+    std::string filename;
+    while (std::getline(files, filename)) {
+        trim(filename);
+        if (filename.empty()) continue;
+        if (filename[0] == '#') continue;
+        sources.push_back(filename);
+    }
+    return true;
+}
+
+void Builder::loadTemplates() {
+    front = readFile("templates/front.html");
+    back = readFile("templates/back.html");
+    frontTemplate.parse(front);
+    backTemplate.parse(back);
+}
+
+// Run one build of the project. In watch mode the articles of this build are
+// kept afterwards so the next build can reuse them.
+int Builder::build() {
+    int result = runPhases();
+    if (tracing) finishTrace(traceFile, showStats, statsCount);
+    if (keepResident) {
+        std::map<std::string, Article*> kept;
+        for (Article *article : document.articles) kept[article->sourceFile] = article;
+        for (auto &iter : resident) {
+            auto now = kept.find(iter.first);
+            if (now == kept.end() || now->second != iter.second) delete iter.second;
+        }
+        resident.swap(kept);
+    }
+    return result;
+}
+
+// The date pages are stamped with.
+static std::string today() {
+    time_t rawtime;
+    struct tm *timeinfo;
+    char buffer[80];
+    time (&rawtime);
+    timeinfo = localtime(&rawtime);
+    strftime(buffer, sizeof(buffer), "%b %d, %Y", timeinfo);
+    return buffer;
+}
+
+// Record what one freshly parsed article adds to the document.
+static void scanArticle(ScanDocument &scanner, Article *article, ErrorLog &errorLog) {
+    TraceSpan span("article", "scan", article->sourceFile);
+    scanner.article = article;
+    scanner.errorLog = &errorLog;
+    article->process(scanner);
+    if (!article->hasPageInfo) {
+        errorLog.add(ErrorType::Warning, article->sourceFile, "Article is missing page info.");
+    }
+}
+
+// Read, parse and scan every source into a fresh document, reusing whatever
+// the last build left that is still current. Returns false if the scan
+// produced errors.
+bool Builder::scan(ErrorLog &errorLog) {
+    TraceSpan span("phase", "scan");
+    document = Document();
+    document.graphicsPath = "./";
+    ScanDocument scanner(&document);
+    genTime = today();
+
+    const bool incremental = havePrevious;
+
+    // Reading and parsing each source is independent, so that runs across the
+    // worker pool; scanning updates the shared link, world and category tables
+    // and runs on this thread in project file order, so nav order and
+    // duplicate-label errors match a serial build. To save memory, each
+    // worker can instead scan its article itself and free the tree at once;
+    // the labels, worlds and categories found are then added to the document
+    // in order, as for an article restored from the manifest.
+    std::cerr << "SCANNING FILES...\n";
+    std::vector<Article*> parsed(sources.size(), nullptr);
+    std::vector<char> restored(sources.size(), false);
+    std::vector<ErrorLog> articleLogs(sources.size());
+    examined.clear();
+    entries.clear();
+    parseCount = 0;
+    parsedNow.clear();
+    runOrdered(sources.size(), jobCount,
+        [&](unsigned i) {
+            const ManifestEntry *entry = incremental ? previous.find(sources[i]) : nullptr;
+            auto kept = resident.find(sources[i]);
+            if (changesKnown && entry && kept != resident.end() && changedSources.count(sources[i]) == 0) {
+                // watch mode knows which files changed, so this one need not
+                // even be read
+                parsed[i] = kept->second;
+                restored[i] = true;
+                replayWarnings(*entry, articleLogs[i]);
+                return;
+            }
+
+            // the source is mapped once, and parsed from the same mapping
+            // it was hashed from if it changed
+            SourceFile *source = SourceFile::open(sources[i]);
+            unsigned long long hash = 0;
+            if (source && source->size <= maxSourceSize) {
+                TraceSpan hashSpan("io", "hash", sources[i]);
+                hash = hashBytes(source->data, source->size);
+            } else {
+                entry = nullptr;
+            }
+            if (entry && entry->sourceHash == hash) {
+                delete source;
+                if (kept != resident.end() && kept->second->sourceHash == hash) {
+                    parsed[i] = kept->second;
+                    replayWarnings(*entry, articleLogs[i]);
+                } else {
+                    parsed[i] = restoreArticle(*entry, articleLogs[i]);
+                }
+                restored[i] = true;
+            } else {
+                parsed[i] = processFile(sources[i], articleLogs[i], hash, source);
+                if (lowMemory && parsed[i]) {
+                    ScanDocument early(nullptr);
+                    scanArticle(early, parsed[i], articleLogs[i]);
+                    unloadArticle(parsed[i]);
+                }
+            }
+        },
+        [&](unsigned i) {
+            Article *a = parsed[i];
+            if (a && restored[i]) {
+                replayScan(document, a, articleLogs[i]);
+            } else if (a && lowMemory) {
+                ++parseCount;
+                replayScan(document, a, articleLogs[i]);
+            } else if (a) {
+                ++parseCount;
+                scanArticle(scanner, a, articleLogs[i]);
+            }
+            if (a) {
+                examined.push_back(document.articles.size());
+                document.addArticle(a);
+                parsedNow.push_back(!restored[i]);
+                entries.push_back(makeManifestEntry(a, articleLogs[i]));
+            }
+            errorLog.append(articleLogs[i]);
+        });
+    document.resolveLinks();
+    buildNavigation(document);
+    return !errorLog.hasErrors();
+}
+
+// The articles an article refers to, each with its first reference there, as
+// Document::resolveLinks() records them in the targets' backlinks.
+typedef std::map<Article*, const Reference*> FirstReferences;
+
+static FirstReferences firstReferences(const Document &document, const Article *article) {
+    FirstReferences first;
+    for (const Reference &reference : article->references) {
+        auto iter = document.links.find(reference.target);
+        if (iter == document.links.end()) continue;
+        Article *target = iter->second.article;
+        if (target && target != article) first.insert(std::make_pair(target, &reference));
+    }
+    return first;
+}
+
+// An article whose backlinks rescan() moves: a changed article, from its old
+// version to its new one, or an unchanged article referring to a label that
+// moved or went away. targets is where it referred to before.
+struct Referrer {
+    Article *before, *after;
+    FirstReferences targets;
+};
+
+static bool sameLabels(const std::vector<LinkTarget> &left, const std::vector<LinkTarget> &right) {
+    if (left.size() != right.size()) return false;
+    for (unsigned i = 0; i < left.size(); ++i) {
+        if (left[i].name != right[i].name || left[i].targetPage != right[i].targetPage
+                || left[i].displayText != right[i].displayText || left[i].isFragment != right[i].isFragment) {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef std::map<std::string, std::vector<Article*>> NavLists;
+typedef std::unordered_map<const Article*, unsigned> ArticleOrder;
+
+// Put an article in the place another held in a world or category list,
+// keeping its neighbours' links to it.
+static void replaceListed(NavLists &lists, const std::string &key, Article *from, Article *to, NavPosition Article::*position) {
+    auto list = lists.find(key);
+    if (list != lists.end()) std::replace(list->second.begin(), list->second.end(), from, to);
+    const NavPosition &place = to->*position;
+    if (place.prev && (place.prev->*position).next == from) (place.prev->*position).next = to;
+    if (place.next && (place.next->*position).prev == from) (place.next->*position).prev = to;
+}
+
+// Take an article out of every world or category list, dropping the lists it
+// leaves empty.
+static void unlist(NavLists &lists, const Article *article) {
+    for (auto iter = lists.begin(); iter != lists.end(); ) {
+        std::vector<Article*> &list = iter->second;
+        list.erase(std::remove(list.begin(), list.end(), article), list.end());
+        if (list.empty()) iter = lists.erase(iter);
+        else ++iter;
+    }
+}
+
+// Add an article to a world or category list in document order.
+static void enlist(std::vector<Article*> &list, Article *article, const ArticleOrder &order) {
+    const unsigned position = order.at(article);
+    auto place = std::find_if(list.begin(), list.end(), [&](const Article *other) { return order.at(other) > position; });
+    list.insert(place, article);
+}
+
+// Patch the document of the last build with the sources watch mode saw
+// change, instead of scanning every source again. Only the changed articles
+// are parsed; the links, nav lists and backlinks they touch are updated in
+// place, and the other articles whose pages they may affect are marked in
+// staleHeaders and staleReferences. Returns false, leaving the document as it
+// was, if a changed source cannot be read, has errors or defines a label
+// another article has, so that scan() reports it as usual.
+bool Builder::rescan(ErrorLog &errorLog) {
+    TraceSpan span("phase", "scan");
+    genTime = today();
+    std::cerr << "SCANNING FILES...\n";
+    const unsigned count = document.articles.size();
+
+    // parse the sources that really changed, in document order
+    std::vector<unsigned> changed;
+    std::vector<Article*> fresh;
+    std::vector<ErrorLog> freshLogs;
+    bool usable = true;
+    for (unsigned i = 0; usable && i < count; ++i) {
+        const Article *old = document.articles[i];
+        if (changedSources.count(old->sourceFile) == 0) continue;
+        SourceFile *source = SourceFile::open(old->sourceFile);
+        if (!source || source->size > maxSourceSize) {
+            delete source;
+            usable = false;
+            break;
+        }
+        unsigned long long hash;
+        {
+            TraceSpan hashSpan("io", "hash", old->sourceFile);
+            hash = hashBytes(source->data, source->size);
+        }
+        if (hash == old->sourceHash) {
+            delete source;
+            continue;
+        }
+        ErrorLog articleLog;
+        Article *article = processFile(old->sourceFile, articleLog, hash, source);
+        if (!article) {
+            usable = false;
+            break;
+        }
+        ScanDocument scanner(nullptr);
+        scanArticle(scanner, article, articleLog);
+        if (lowMemory) unloadArticle(article);
+        changed.push_back(i);
+        fresh.push_back(article);
+        freshLogs.push_back(articleLog);
+        if (articleLog.hasErrors()) usable = false;
+    }
+
+    // the labels of the changed articles all come out before any go back
+    // in, so one may move between them, but not onto another article's
+    std::set<std::string> released, claimed;
+    for (unsigned i : changed) {
+        for (const LinkTarget &label : document.articles[i]->labels) released.insert(label.name);
+    }
+    for (const Article *article : fresh) {
+        for (const LinkTarget &label : article->labels) {
+            if (!claimed.insert(label.name).second || (released.count(label.name) == 0 && document.links.count(label.name) != 0)) {
+                usable = false;
+            }
+        }
+    }
+    if (!usable) {
+        for (Article *article : fresh) delete article;
+        return false;
+    }
+
+    examined.clear();
+    entries.clear();
+    parsedNow.clear();
+    parseCount = changed.size();
+    staleHeaders.assign(count, false);
+    staleReferences.assign(count, false);
+    linksChanged = indexInputsChanged = false;
+
+    // Note where everything referred before the links change. An article
+    // referring to a label that moves or goes away is in the backlinks of
+    // the article that had it.
+    std::vector<Article*> superseded;
+    std::map<Article*, Article*> replaced;
+    ArticleOrder order;
+    for (unsigned k = 0; k < changed.size(); ++k) {
+        superseded.push_back(document.articles[changed[k]]);
+        replaced[superseded[k]] = fresh[k];
+        order[superseded[k]] = changed[k];
+    }
+    std::vector<Referrer> referrers;
+    std::set<Article*> lookedUp;
+    for (unsigned k = 0; k < changed.size(); ++k) {
+        Article *old = superseded[k], *article = fresh[k];
+        referrers.push_back(Referrer{old, article, firstReferences(document, old)});
+        if (!sameLabels(old->labels, article->labels)) linksChanged = true;
+        if (old->hasPageInfo != article->hasPageInfo || old->world != article->world || old->category != article->category) {
+            indexInputsChanged = true;
+        }
+
+        std::set<std::pair<std::string, bool>> kept;
+        for (const LinkTarget &label : article->labels) kept.insert(std::make_pair(label.name, label.isFragment));
+        bool lost = false;
+        for (const LinkTarget &label : old->labels) {
+            if (kept.count(std::make_pair(label.name, label.isFragment)) == 0) lost = true;
+        }
+        if (!lost) continue;
+        for (const Backlink &backlink : old->referencedBy) {
+            if (replaced.count(backlink.from) == 0 && lookedUp.insert(backlink.from).second) {
+                referrers.push_back(Referrer{backlink.from, backlink.from, firstReferences(document, backlink.from)});
+            }
+        }
+    }
+    if (linksChanged) indexInputsChanged = true;
+
+    // put the new articles in place of the old, each taking over the
+    // backlinks the old one had
+    for (Article *old : superseded) {
+        for (const LinkTarget &label : old->labels) document.links.erase(label.name);
+    }
+    for (unsigned k = 0; k < changed.size(); ++k) {
+        Article *old = superseded[k], *article = fresh[k];
+        document.articles[changed[k]] = article;
+        auto file = document.files.find(article->filename);
+        if (file != document.files.end() && file->second == old) file->second = article;
+        article->referencedBy.swap(old->referencedBy);
+        for (const LinkTarget &label : article->labels) {
+            document.links.insert(std::make_pair(label.name, label)).first->second.article = article;
+        }
+    }
+    for (unsigned i = 0; i < count; ++i) order[document.articles[i]] = i;
+
+    // Move each referrer's backlinks to where it refers now. A target's page
+    // changes if a backlink comes or goes, or shows a different name or
+    // anchor.
+    for (Referrer &referrer : referrers) {
+        if (referrer.before == referrer.after) staleReferences[order.at(referrer.after)] = true;
+        const bool renamed = referrer.before->name != referrer.after->name;
+        FirstReferences now = firstReferences(document, referrer.after);
+        for (const auto &iter : referrer.targets) {
+            auto swapped = replaced.find(iter.first);
+            Article *target = swapped == replaced.end() ? iter.first : swapped->second;
+            std::vector<Backlink> &backlinks = target->referencedBy;
+            auto backlink = std::find_if(backlinks.begin(), backlinks.end(), [&](const Backlink &other) { return other.from == referrer.before; });
+            if (backlink == backlinks.end()) continue;
+            auto reference = now.find(target);
+            if (reference == now.end()) {
+                backlinks.erase(backlink);
+                staleReferences[order.at(target)] = true;
+                continue;
+            }
+            if (renamed || reference->second->anchor != backlink->reference->anchor) staleReferences[order.at(target)] = true;
+            backlink->from = referrer.after;
+            backlink->reference = reference->second;
+            now.erase(reference);
+        }
+        const unsigned position = order.at(referrer.after);
+        for (const auto &iter : now) {
+            std::vector<Backlink> &backlinks = iter.first->referencedBy;
+            auto place = std::find_if(backlinks.begin(), backlinks.end(), [&](const Backlink &other) { return order.at(other.from) > position; });
+            backlinks.insert(place, Backlink{referrer.after, iter.second});
+            staleReferences[order.at(iter.first)] = true;
+        }
+    }
+
+    // An article listed where the old one was takes over its place. One
+    // that moves, or whose title changes, changes the nav bars of its old
+    // and new neighbours.
+    std::vector<Article*> neighbours;
+    for (unsigned k = 0; k < changed.size(); ++k) {
+        Article *old = superseded[k], *article = fresh[k];
+        if (old->hasPageInfo == article->hasPageInfo && old->world == article->world
+                && old->category == article->category && old->name == article->name) {
+            article->worldPos = old->worldPos;
+            article->categoryPos = old->categoryPos;
+            article->worldNav = old->worldNav;
+            article->catNav = old->catNav;
+            replaceListed(document.worlds, old->world, old, article, &Article::worldPos);
+            replaceListed(document.categories, old->category, old, article, &Article::categoryPos);
+            continue;
+        }
+        for (const NavPosition *place : { &old->worldPos, &old->categoryPos }) {
+            neighbours.push_back(place->prev);
+            neighbours.push_back(place->next);
+        }
+        neighbours.push_back(article);
+        unlist(document.worlds, old);
+        unlist(document.categories, old);
+        if (article->hasPageInfo) {
+            enlist(document.worlds[article->world], article, order);
+            enlist(document.categories[article->category], article, order);
+        }
+    }
+    if (!neighbours.empty()) {
+        buildNavigation(document);
+        for (Article *article : fresh) {
+            for (const NavPosition *place : { &article->worldPos, &article->categoryPos }) {
+                neighbours.push_back(place->prev);
+                neighbours.push_back(place->next);
+            }
+        }
+        for (Article *neighbour : neighbours) {
+            if (neighbour) staleHeaders[order.at(neighbour)] = true;
+        }
+    }
+
+    for (unsigned i = 0, k = 0; i < count; ++i) {
+        if (k < changed.size() && changed[k] == i) {
+            examined.push_back(i);
+            parsedNow.push_back(true);
+            entries.push_back(makeManifestEntry(fresh[k], freshLogs[k]));
+            errorLog.append(freshLogs[k]);
+            ++k;
+        } else if (const ManifestEntry *entry = previous.find(document.articles[i]->sourceFile)) {
+            replayWarnings(*entry, errorLog);
+        }
+    }
+    return true;
+}
+
+// Save the manifest of the last successful build, and drop the cached trees no
+// article of it uses.
+void Builder::saveManifest() {
+    if (!previous.save(manifestFile)) {
+        std::cerr << "Failed to write build manifest " << manifestFile << "\n";
+    }
+    if (useAstCache) pruneAstCache(document);
+    manifestPending = false;
+}
+
+// Render one article's page, loading its text first if it was restored from
+// the manifest or unloaded after the scan. Its words are collected into
+// searchTerms on the way, if given.
+bool Builder::renderArticle(Article *article, const PageFields &fields, std::ostream &page, ErrorLog &errorLog, SearchTerms *searchTerms) {
+    if (!article->isLoaded) {
+        // the scan already reported what parsing the source finds, so only
+        // a failure to load it now is worth adding
+        ErrorLog loadLog;
+        if (!loadArticle(article, loadLog)) {
+            errorLog.append(loadLog);
+            return false;
+        }
+    }
+
+    TraceSpan span("article", "render", article->sourceFile);
+
+    frontTemplate.write(page, fields);
+    FormatDocument dd(&document, page);
+    dd.errorLog = &errorLog;
+    dd.article = article;
+    if (searchTerms) {
+        searchTerms->clear();
+        searchTerms->addTitle(article->name);
+        dd.searchTerms = searchTerms;
+    }
+    article->process(dd);
+    if (searchTerms) searchTerms->finish();
+    writeBacklinks(page, article);
+    backTemplate.write(page, fields);
+    return true;
+}
+
+int Builder::runPhases() {
+    ErrorLog errorLog;
+
+    // The manifest from the last successful build lets unchanged sources skip
+    // parsing and unaffected pages skip rendering.
+    const bool incremental = havePrevious;
+    BuildManifest current;
+    current.templateHash = hashText(back, hashText(front));
+    const bool templatesChanged = !incremental || previous.templateHash != current.templateHash;
+
+    // In watch mode, a build that follows a successful one with the same
+    // templates patches its document with what changed instead.
+    bool partial = documentCurrent && changesKnown && !templatesChanged;
+    documentCurrent = false;
+
+    std::chrono::milliseconds scanStart = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    if (partial) partial = rescan(errorLog);
+    if (partial || scan(errorLog)) prepareImages(document, incremental ? &previous : nullptr, true, errorLog);
+    if (partial && !errorLog.hasErrors()) {
+        // the rescan only looked at the articles that changed, so the
+        // others whose pages may be affected are looked at too, as are
+        // those showing an image whose copy changed
+        markChangedImages(document, previous, staleReferences);
+        std::vector<char> parsed(document.articles.size(), false);
+        for (unsigned i : examined) parsed[i] = true;
+        for (unsigned i = 0; i < document.articles.size(); ++i) {
+            if (parsed[i] || !(staleHeaders[i] || staleReferences[i])) continue;
+            examined.push_back(i);
+            entries.push_back(*previous.find(document.articles[i]->sourceFile));
+            parsedNow.push_back(false);
+        }
+    }
+    if (incremental) {
+        std::cerr << "Parsed " << parseCount << " of " << sources.size() << " source files.\n";
+    }
+    std::chrono::milliseconds scanEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    std::cerr << "Completed in " << (scanEnd - scanStart).count() << " ms.\n\n";
+
+    if (errorLog.hasErrors()) {
+        dumpErrors(errorLog, hideWarnings);
+        return 1;
+    }
+
+
+    std::chrono::milliseconds writeStart = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    std::cerr << "WRITING FILES...\n";
+    TraceSpan writeSpan("phase", "write");
+    // A page needs to be written again if its source changed, or if its
+    // header (title and nav bars) or the targets of its \pageref links differ
+    // from the last build. Rendering also collects its words for the search
+    // index, so a page whose words were not kept is written again too, as is
+    // one that lacks the compressed copies -compress asks for. After a
+    // rescan, only the hashes it marked stale are worked out again.
+    std::vector<PageFields> fields(document.articles.size());
+    for (unsigned i = 0; i < document.articles.size(); ++i) {
+        makePageFields(document.articles[i], fields[i]);
+        fields[i].genTime = genTime;
+    }
+    std::vector<unsigned> schedule;
+    for (unsigned k = 0; k < examined.size(); ++k) {
+        const unsigned i = examined[k];
+        Article *article = document.articles[i];
+        ManifestEntry &entry = entries[k];
+        if (!partial || parsedNow[k] || staleHeaders[i]) {
+            entry.headerHash = hashText(fields[i].title + '\n' + fields[i].catNav + '\n' + fields[i].worldNav);
+        }
+        if (!partial || parsedNow[k] || staleReferences[i]) entry.referenceHash = hashReferences(document, article);
+
+        const ManifestEntry *old = incremental ? previous.find(article->sourceFile) : nullptr;
+        if (templatesChanged || parsedNow[k] || !old
+                || old->headerHash != entry.headerHash
+                || old->referenceHash != entry.referenceHash
+                || (!changesKnown && (!fileExists("out/" + article->filename) || (searchIndex && !haveSearchTerms(article))))
+                || lacksCompressedCopies(previous, "out/" + article->filename)) {
+            schedule.push_back(i);
+        }
+    }
+
+    // Articles only read the shared document while rendering, so each worker
+    // renders into its own buffer and error log. The largest sources are
+    // scheduled first so a single huge article does not finish last.
+    std::stable_sort(schedule.begin(), schedule.end(), [&](unsigned left, unsigned right) {
+        return document.articles[left]->sourceSize > document.articles[right]->sourceSize;
+    });
+    std::vector<ErrorLog> writeLogs(document.articles.size());
+    // with -lowmem each article's words only go to out/.search, and the
+    // search index is built from there
+    std::vector<SearchTerms> searchTerms(lowMemory ? 0 : document.articles.size());
+    std::vector<char> rendered(document.articles.size(), false);
+    PageWriter writer(jobCount, useUring);
+    // rendering stays only a little ahead of the disk, so finished pages do
+    // not pile up in memory
+    if (lowMemory) writer.maxQueued = jobCount;
+    if (incremental) current.compressed = previous.compressed;
+    CompressingOutput output(writer, previous.compressed, current.compressed);
+    runParallel(schedule.size(), jobCount, [&](unsigned n) {
+        unsigned i = schedule[n];
+        Article *article = document.articles[i];
+        std::ostringstream page;
+        SearchTerms scratch;
+        SearchTerms &terms = lowMemory ? scratch : searchTerms[i];
+        if (renderArticle(article, fields[i], page, writeLogs[i], searchIndex ? &terms : nullptr)) {
+            output.submit("out/" + article->filename, page.str());
+            // -lowmem reads the words back for the index before the writer
+            // is done, so they are written straight away; words kept from
+            // before the page changed would be wrong
+            if (searchIndex) saveSearchTerms(article, terms, lowMemory ? nullptr : &writer);
+            else removeSearchTerms(article->filename);
+            rendered[i] = true;
+        }
+        if (lowMemory) unloadArticle(article);
+    });
+    for (unsigned i = 0; i < document.articles.size(); ++i) {
+        errorLog.append(writeLogs[i]);
+    }
+    if (incremental) {
+        std::cerr << "Wrote " << schedule.size() << " of " << document.articles.size() << " articles.\n";
+        // a rescan keeps every article
+        if (!partial) removeStaleOutput(previous, document, current);
+    }
+    writeSpan.finish();
+    std::chrono::milliseconds writeEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    std::cerr << "Completed in " << (writeEnd - writeStart).count() << " ms.\n\n";
+
+    if (errorLog.hasErrors()) {
+        dumpErrors(errorLog, hideWarnings);
+        return 1;
+    }
+
+    std::chrono::milliseconds indexesStart = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    std::cerr << "WRITING INDEXES...\n";
+    TraceSpan indexesSpan("phase", "indexes");
+    current.indexHash = partial && !indexInputsChanged ? previous.indexHash : hashIndexInputs(document);
+    if (!templatesChanged && previous.indexHash == current.indexHash
+            && fileExists("out/by_alpha.html") && fileExists("out/by_world.html")
+            && fileExists("out/by_category.html")
+            && !lacksCompressedCopies(previous, "out/by_alpha.html") && !lacksCompressedCopies(previous, "out/by_world.html")
+            && !lacksCompressedCopies(previous, "out/by_category.html")) {
+        std::cerr << "Indexes unchanged.\n";
+    } else {
+        make_indexes(frontTemplate, backTemplate, genTime, document, output);
+    }
+
+    // The search index changes whenever a page does, or an article is gone.
+    // Without one, the index left from before is marked as out of date, so
+    // the next build that has one writes it all again.
+    if (!searchIndex) {
+        std::remove("out/search/index.json");
+        removeCompressedCopies("out/search/index.json");
+        residentTerms.clear();
+        searchPages.clear();
+    } else if (!schedule.empty() || !incremental || previous.entries.size() != document.articles.size()
+            || !fileExists("out/search/index.json") || lacksCompressedCopies(previous, "out/search/index.json")) {
+        if (lowMemory) {
+            // the words are read back one article at a time and the shards
+            // built a bucket at a time, so they are never all in memory
+            streamSearchIndex(document, [&](unsigned i, SearchTerms &terms) {
+                if (loadSearchTerms(document.articles[i], terms)) return true;
+                std::ostringstream page;
+                ErrorLog ignored;
+                bool collected = renderArticle(document.articles[i], fields[i], page, ignored, &terms);
+                if (collected) saveSearchTerms(document.articles[i], terms);
+                unloadArticle(document.articles[i]);
+                return collected;
+            }, output);
+            residentTerms.clear();
+            searchPages.clear();
+        } else {
+            std::vector<std::string> pages;
+            for (const Article *article : document.articles) pages.push_back(article->filename);
+            std::vector<const SearchTerms*> terms(document.articles.size());
+            runParallel(document.articles.size(), jobCount, [&](unsigned i) {
+                terms[i] = &searchTerms[i];
+                if (rendered[i]) return;
+                auto kept = residentTerms.find(document.articles[i]->sourceFile);
+                if (kept != residentTerms.end()) {
+                    terms[i] = &kept->second;
+                    return;
+                }
+                if (loadSearchTerms(document.articles[i], searchTerms[i])) return;
+                // the words kept for the page are missing, so collect them again
+                std::ostringstream page;
+                ErrorLog ignored;
+                if (renderArticle(document.articles[i], fields[i], page, ignored, &searchTerms[i])) {
+                    saveSearchTerms(document.articles[i], searchTerms[i], &writer);
+                }
+            });
+
+            // When the words the index was last written from are all still
+            // in memory and the articles are numbered as before, only the
+            // shards of words that changed and the documents files of
+            // retitled articles are written again.
+            SearchIndexChanges changes;
+            changes.all = !keepResident || pages != searchPages || !fileExists("out/search/index.json");
+            for (unsigned i = 0; !changes.all && i < document.articles.size(); ++i) {
+                const Article *article = document.articles[i];
+                auto kept = residentTerms.find(article->sourceFile);
+                const ManifestEntry *old = previous.find(article->sourceFile);
+                if (kept == residentTerms.end() || !old) {
+                    changes.all = true;
+                } else if (terms[i] != &kept->second && !(*terms[i] == kept->second)) {
+                    changes.addChangedTerms(kept->second, *terms[i]);
+                }
+                if (old && old->name != article->name) changes.addDocument(i);
+            }
+            writeSearchIndex(document, terms, changes, output);
+
+            if (keepResident) {
+                std::map<std::string, SearchTerms> kept;
+                for (unsigned i = 0; i < document.articles.size(); ++i) {
+                    const std::string &sourceFile = document.articles[i]->sourceFile;
+                    kept[sourceFile] = std::move(terms[i] == &searchTerms[i] ? searchTerms[i] : residentTerms[sourceFile]);
+                }
+                residentTerms.swap(kept);
+                searchPages.swap(pages);
+            }
+        }
+    }
+
+    // a rescan that changed no label leaves the list of them as it was
+    if (!partial || linksChanged) {
+        std::ostringstream linkFile;
+        for (const auto &iter : document.links) {
+            linkFile << iter.first << " :: " << iter.second.name << "/" << iter.second.targetPage << "/" << iter.second.isFragment << "\n";
+        }
+        output.submit("links.lst", linkFile.str());
+    }
+    for (const std::string &failed : writer.finish()) {
+        std::cerr << "Failed to write output file " << failed << "\n";
+    }
+    indexesSpan.finish();
+    std::chrono::milliseconds indexesEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    std::cerr << "Completed in " << (indexesEnd - indexesStart).count() << " ms.\n\n";
+
+    if (errorLog.hasErrors()) {
+        dumpErrors(errorLog, hideWarnings);
+        return 1;
+    }
+
+
+    if (showOrphans) reportOrphans(document);
+
+    // a rescan only made entries for the articles it looked at
+    if (partial) current.entries.swap(previous.entries);
+    for (ManifestEntry &entry : entries) {
+        current.entries[entry.sourceFile] = std::move(entry);
+    }
+    entries.clear();
+    current.images = document.images;
+    previous = std::move(current);
+    havePrevious = true;
+    changedSources.clear();
+    // watch mode saves the manifest once it is idle, so patched rebuilds do
+    // not wait for it
+    documentCurrent = keepResident;
+    if (partial) manifestPending = true;
+    else saveManifest();
+
+    if (!errorLog.isEmpty()) {
+        dumpErrors(errorLog, hideWarnings);
+    }
+    std::cerr << "Total runtime: " << ((scanEnd - scanStart) + (writeEnd - writeStart) + (indexesEnd - indexesStart)).count() << " ms.\n";
+
+    return 0;
+}
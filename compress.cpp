@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "latexwiki.h"
+
+bool compressOutput = false;
+
+// Middling levels: pages are compressed on the render threads, and the
+// strongest levels take several times as long to save a few percent.
+static const int gzipLevel = 6;
+#ifdef HAVE_ZSTD
+static const int zstdLevel = 6;
+#endif
+
+static const char *compressedSuffixes[] = {
+    ".gz",
+#ifdef HAVE_ZSTD
+    ".zst",
+#endif
+};
+
+static bool gzipText(const std::string &text, std::string &out) {
+    z_stream stream = z_stream();
+    // 16 added to the window size asks for a gzip header and trailer
+    if (deflateInit2(&stream, gzipLevel, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    out.resize(deflateBound(&stream, text.size()));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+    stream.avail_in = text.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = out.size();
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+#ifdef HAVE_ZSTD
+static bool zstdText(const std::string &text, std::string &out) {
+    out.resize(ZSTD_compressBound(text.size()));
+    std::size_t size = ZSTD_compress(&out[0], out.size(), text.data(), text.size(), zstdLevel);
+    if (ZSTD_isError(size)) return false;
+    out.resize(size);
+    return true;
+}
+#endif
+
+// The name of the file a compressed copy is of; other names are returned
+// unchanged.
+std::string uncompressedName(const std::string &filename) {
+    for (const char *suffix : compressedSuffixes) {
+        const std::string::size_type length = std::strlen(suffix);
+        if (filename.size() > length && filename.compare(filename.size() - length, length, suffix) == 0) {
+            return filename.substr(0, filename.size() - length);
+        }
+    }
+    return filename;
+}
+
+void removeCompressedCopies(const std::string &filename) {
+    for (const char *suffix : compressedSuffixes) {
+        std::remove((filename + suffix).c_str());
+    }
+}
+
+
+CompressingOutput::CompressingOutput(PageOutput &output, const std::map<std::string, unsigned long long> &previous, std::map<std::string, unsigned long long> &current)
+: output(output), previous(previous), current(current)
+{ }
+
+// Compress a page on the thread that made it, then hand the page and its
+// compressed copies on. A page whose content is what was compressed last
+// time keeps the copies it has. With compression off, copies left by an
+// earlier build are removed so they cannot go stale.
+void CompressingOutput::submit(const std::string &filename, std::string &&content) {
+    if (!compressOutput) {
+        bool had;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            had = current.erase(filename) != 0;
+        }
+        if (had) removeCompressedCopies(filename);
+        output.submit(filename, std::move(content));
+        return;
+    }
+
+    const unsigned long long hash = hashText(content);
+    auto last = previous.find(filename);
+    bool unchanged = last != previous.end() && last->second == hash;
+    for (const char *suffix : compressedSuffixes) {
+        if (unchanged && !fileExists(filename + suffix)) unchanged = false;
+    }
+    bool compressed = true;
+    if (!unchanged) {
+        TraceSpan span("io", "compress", filename);
+        std::string gzip;
+        compressed = gzipText(content, gzip);
+#ifdef HAVE_ZSTD
+        std::string zstd;
+        compressed = compressed && zstdText(content, zstd);
+#endif
+        if (compressed) {
+            output.submit(filename + ".gz", std::move(gzip));
+#ifdef HAVE_ZSTD
+            output.submit(filename + ".zst", std::move(zstd));
+#endif
+        } else {
+            removeCompressedCopies(filename);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (compressed) current[filename] = hash;
+        else current.erase(filename);
+    }
+    output.submit(filename, std::move(content));
+}
@@ -14,6 +14,13 @@ void ErrorLog::add(ErrorType type, const std::string &file, const std::string &m
     errors.push_back(ErrorMsg{type, file, msg});
 }
 
+void ErrorLog::append(const ErrorLog &other) {
+    warnCount += other.warnCount;
+    errorCount += other.errorCount;
+    fatalCount += other.fatalCount;
+    errors.insert(errors.end(), other.errors.begin(), other.errors.end());
+}
+
 bool ErrorLog::hasErrors() const {
     return errorCount > 0 || fatalCount > 0;
 }
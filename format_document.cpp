@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -5,79 +6,95 @@
 #include "latexwiki.h"
 
 FormatDocument::FormatDocument(Document *article, std::ostream &out)
-: out(out), document(article)
+: out(out), document(article), textMode(TextMode::Prose), searchTerms(nullptr), searchWeight(1)
 { }
 
-void FormatDocument::handle(Node *node) {
-    if (node) node->handle(this);
+void FormatDocument::handle(unsigned node) {
+    if (node == noNode) return;
+    const SyntaxTree &tree = article->tree;
+    switch (tree.nodes[node].kind) {
+    case NodeKind::Paragraph:
+        out << "<p>";
+        handleChildren(node);
+        out << "\n\n";
+        break;
+    case NodeKind::Fragment:
+        handleChildren(node);
+        break;
+    case NodeKind::Command:
+        handleCommand(node);
+        break;
+    case NodeKind::Text:
+        // write text straight from the source as HTML; see writeHtmlText()
+        writeHtmlText(out, tree.text(node), textMode);
+        if (searchTerms && textMode != TextMode::Attribute) searchTerms->add(tree.text(node), searchWeight);
+        break;
+    case NodeKind::EscapedText:
+        writeHtmlText(out, tree.text(node), textMode == TextMode::Prose ? TextMode::Literal : textMode);
+        if (searchTerms && textMode != TextMode::Attribute) searchTerms->add(tree.text(node), searchWeight);
+        break;
+    }
 }
 
-void FormatDocument::handle(Fragment *fragment) {
-    for (Node *c : fragment->children) {
+void FormatDocument::handleChildren(unsigned node) {
+    const Node *nodes = article->tree.nodes;
+    for (unsigned c = node + 1; c < nodes[node].next; c = nodes[c].next) {
         handle(c);
     }
 }
 
-void FormatDocument::handle(Text *text) {
-    std::string result = text->text;
-    replaceText(result, "``", "&ldquo;");
-    replaceText(result, "''", "&rdquo;");
-    out << result;
+// Write a node with its text written in the given mode.
+void FormatDocument::handleAs(unsigned node, TextMode mode) {
+    TextMode oldMode = textMode;
+    textMode = mode;
+    handle(node);
+    textMode = oldMode;
 }
 
-void FormatDocument::handle(Command *command) {
-    if (command->command == "pageinfo") {
-    } else if (command->command == "section" || command->command == "chapter") {
-        out << "<h2>";
-        handle(command->children.front());
-        out << "</h2>";
-    } else if (command->command == "subsection") {
-        out << "<h3>";
-        handle(command->children.front());
-        out << "</h3>";
-    } else if (command->command == "subsubsection") {
-        out << "<h4>";
-        handle(command->children.front());
-        out << "</h4>";
-    } else if (command->command == "paragraph") {
-        out << "<span class='parahead'>";
-        handle(command->children.front());
-        out << "</span>";
-    } else if (command->command == "label") {
+void FormatDocument::handleCommand(unsigned command) {
+    const SyntaxTree &tree = article->tree;
+    const CommandId id = tree.nodes[command].id;
+    CommandTimer timer(id);
+    switch (id) {
+    case CommandId::label: {
         out << "<span id='";
-        Text *t = dynamic_cast<Text*>(command->children.front());
-        if (t) {
-            out << t->text;
+        unsigned t = tree.child(command, 0);
+        if (tree.isText(t)) {
+            out << tree.str(t);
+            if (searchTerms) searchTerms->addAnchor(tree.str(t));
         } else {
             errorLog->add(ErrorType::Error, article->sourceFile, "Invalid content in label text.");
         }
         out << "'></span>";
-    } else if (command->command == "addlabel") {
+        break; }
+    case CommandId::addlabel: {
         out << "<span id='";
-        Text *t = dynamic_cast<Text*>(command->at(1));
-        if (t) {
-            out << t->text;
+        unsigned t = tree.child(command, 1);
+        if (tree.isText(t)) {
+            out << tree.str(t);
+            if (searchTerms) searchTerms->addAnchor(tree.str(t));
         } else {
             errorLog->add(ErrorType::Error, article->sourceFile, "Invalid content in label text.");
         }
         out << "'></span>";
-    } else if (command->command == "pr") {
-        Text *name = dynamic_cast<Text*>(command->at(0));
-        if (!name) {
+        break; }
+    case CommandId::pr: {
+        if (!tree.isText(tree.child(command, 0))) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Label text may not contain commands.");
             return;
         }
-    } else if (command->command == "pageref") {
-        Text *name = dynamic_cast<Text*>(command->at(0));
-        if (!name) {
+        break; }
+    case CommandId::pageref: {
+        unsigned name = tree.child(command, 0);
+        if (!tree.isText(name)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Label text may not contain commands.");
             return;
         }
 
         out << "(<a class='pageref' href='";
-        auto iter = document->links.find(name->text);
+        auto iter = document->links.find(tree.str(name));
         if (iter == document->links.end()) {
-            errorLog->add(ErrorType::Error, article->sourceFile, "Unknown link target \"" + name->text + "\".");
+            errorLog->add(ErrorType::Error, article->sourceFile, "Unknown link target \"" + tree.str(name) + "\".");
             out << "name->text";
         } else {
             out << iter->second.targetPage;
@@ -86,173 +103,93 @@ void FormatDocument::handle(Command *command) {
             }
         }
         out << "'>link</a>)";
+        break; }
 
-    } else if (command->command == "href") {
-        out << "<a href='";
-        handle(command->at(0));
-        out << "'>";
-        handle(command->at(1));
-        out << "</a>";
-    } else if (command->command == "url") {
+    case CommandId::narrowimage:
+    case CommandId::mediumimage:
+    case CommandId::wideimage: {
+        // images prepared by prepareImages() are shown from their copies, at
+        // their own size
+        unsigned name = tree.child(command, 0);
+        auto image = tree.isText(name) ? document->images.find(tree.str(name)) : document->images.end();
+        out << "<figure class='" << getCommandInfo(id).name << "'><img src='";
+        if (image != document->images.end() && image->second.found) {
+            const ImageAsset &asset = image->second;
+            writeHtmlText(out, StringView(asset.output.data(), asset.output.size()), TextMode::Attribute);
+            out << "' width='" << asset.width << "' height='" << asset.height << "' loading='lazy'>";
+        } else {
+            out << document->graphicsPath;
+            handleAs(name, TextMode::Attribute);
+            out << ".png'>";
+        }
+        out << "<br><caption>";
+        handle(tree.child(command, 1));
+        out << "</caption></figure>";
+        break; }
+
+    case CommandId::url:
         out << "<a href='";
-        handle(command->at(0));
+        handleAs(tree.child(command, 0), TextMode::Attribute);
         out << "'>";
-        handle(command->at(0));
+        handleAs(tree.child(command, 0), TextMode::Literal);
         out << "</a>";
-    } else if (command->command == "emph") {
-        out << "<i>";
-        handle(command->children.front());
-        out << "</i>";
-    } else if (command->command == "textbf") {
-        out << "<b>";
-        handle(command->children.front());
-        out << "</b>";
-    } else if (command->command == "nexustext") {
-        out << "<span class='nexustext'>";
-        handle(command->children.front());
-        out << "</span>";
-    } else if (command->command == "vocab") {
-        out << "<p><span class='nexustext'>";
-        handle(command->at(1));
-        out << "</span> <b>";
-        handle(command->at(0));
-        out << "</b> ";
-        handle(command->at(2));
-        out << " <i>";
-        handle(command->at(3));
-        out << ".</i> ";
-        handle(command->at(4));
-        out << "</p>";
-
-    } else if (command->command == "narrowimage") {
-        out << "<figure class='narrowimage'><img src='" << document->graphicsPath;
-        handle(command->children.front());
-        out << ".png'><br><caption>";
-        handle(command->at(1));
-        out << "</caption></figure>";
-    } else if (command->command == "mediumimage") {
-        out << "<figure class='mediumimage'><img src='" << document->graphicsPath;
-        handle(command->children.front());
-        out << ".png'><br><caption>";
-        handle(command->at(1));
-        out << "</caption></figure>";
-    } else if (command->command == "wideimage") {
-        out << "<figure class='wideimage'><img src='" << document->graphicsPath;
-        handle(command->children.front());
-        out << ".png'><br><caption>";
-        handle(command->at(1));
-        out << "</caption></figure>";
-
-    } else if (command->command == "startinfobox") {
-        out << "<table class='infobox'>";
-    } else if (command->command == "stopinfobox") {
-        out << "</table>";
-    } else if (command->command == "infoline") {
-        out << "<tr><td class='infoleft'>";
-        handle(command->at(0));
-        out << "</td><td class='inforight'>";
-        handle(command->at(1));
-        out << "</td></tr>";
-    } else if (command->command == "infotitle") {
-        out << "<tr><td colspan='2' class='infotitle'>";
-        handle(command->at(0));
-        out << "</td></tr>";
-    } else if (command->command == "infohead") {
-        out << "<tr><td colspan='2' class='infohead'>";
-        handle(command->at(0));
-        out << "</td></tr>";
-
-    } else if (command->command == "startdblinfobox") {
-        out << "<table class='dblinfobox'>";
-    } else if (command->command == "stopdblinfobox") {
-        out << "</table>";
-    } else if (command->command == "dblinfoline") {
-        out << "<tr><td class='dblinfoleft'>";
-        handle(command->at(0));
-        out << "</td><td class='dblinforight'>";
-        handle(command->at(1));
-        out << "</td><td class='dblinfoleft'>";
-        handle(command->at(2));
-        out << "</td><td class='dblinforight'>";
-        handle(command->at(3));
-        out << "</td></tr>";
-    } else if (command->command == "dblinfotitle") {
-        out << "<tr><td colspan='4' class='dblinfotitle'>";
-        handle(command->at(0));
-        out << "</td></tr>";
-
-    } else if (command->command == "startorbittable") {
-        out << "<table class='orbittable'>\n";
-        out << "<tr><th>Orbit</th><th>Radius (AU)</th><th>Type</th><th>BB Temp (K)</th><th>Moonlets</th>\n";
-    } else if (command->command == "stoporbittable") {
-        out << "</table>\n";
-    } else if (command->command == "planetrow") {
-        out << "<tr class='planet'><td>";
-        handle(command->at(0));
-        out << "</td><td>";
-        handle(command->at(1));
-        out << "</td><td>";
-        handle(command->at(2));
-        out << "</td><td>";
-        handle(command->at(3));
-        out << "</td><td>";
-        handle(command->at(4));
-        out << "</td></tr>\n";
-    } else if (command->command == "moonrow") {
-        out << "<tr class='moon'><td>";
-        handle(command->at(0));
-        out << "</td><td></td><td>";
-        handle(command->at(1));
-        out << "</td></tr>\n";
+        break;
 
-    } else if (command->command == "begin") {
-        Text *text = dynamic_cast<Text*>(command->at(0));
-        if (!text) {
+    case CommandId::begin: {
+        unsigned text = tree.child(command, 0);
+        if (!tree.isText(text)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Environment name must be text.");
         } else {
-            if (text->text == "description")    out << "<ul>\n";
-            else if (text->text == "itemize")   out << "<ol>\n";
+            if (tree.text(text) == "description")    out << "<ul>\n";
+            else if (tree.text(text) == "itemize")   out << "<ol>\n";
         }
-    } else if (command->command == "end") {
-        Text *text = dynamic_cast<Text*>(command->at(0));
-        if (!text) {
+        break; }
+    case CommandId::end: {
+        unsigned text = tree.child(command, 0);
+        if (!tree.isText(text)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Environment name must be text.");
         } else {
-            if (text->text == "description")    out << "</ul>\n";
-            else if (text->text == "itemize")   out << "</ol>\n";
+            if (tree.text(text) == "description")    out << "</ul>\n";
+            else if (tree.text(text) == "itemize")   out << "</ol>\n";
         }
-    } else if (command->command == "item") {
+        break; }
+    case CommandId::item:
         out << "<li>";
-        if (command->size() > 0) {
+        if (tree.child(command, 0) != noNode) {
             out << "<span class='lihead'>";
-            handle(command->at(0));
+            handle(tree.child(command, 0));
             out << "</span>";
         }
+        break;
 
-    } else if (command->command == "LaTeX") {
-        out << "LaTeX";
-    } else if (command->command == "degree") {
-        out << "&deg;";
-    } else if (command->command == "times") {
-        out << "&times;";
-    } else if (command->command == "LaTeX") {
-        out << "LaTeX";
-    } else if (command->command == "parbox") {
-        handle(command->at(1));
-    } else if (command->command == "clearpage" || command->command == "textwidth"
-            || command->command == "linewidth") {
-        // do nothing
-    } else {
-        for (Node *c : command->children) {
-            handle(c);
-        }
+    default: {
+        // words in headings count for more in the search index
+        const unsigned oldWeight = searchWeight;
+        searchWeight = std::max(searchWeight, headingWeight(id));
+        handleFormat(command, getCommandInfo(id).format);
+        searchWeight = oldWeight;
+        break; }
     }
 }
 
-void FormatDocument::handle(Paragraph *paragraph) {
-    out << "<p>";
-    for (Node *c : paragraph->children) {
-        handle(c);
+// Write a command using the output format from the command table.
+void FormatDocument::handleFormat(unsigned command, const char *format) {
+    if (!format) {
+        handleChildren(command);
+        return;
+    }
+
+    const SyntaxTree &tree = article->tree;
+    const char *start = format;
+    for (const char *c = format; *c; ++c) {
+        if (c[0] == '%' && c[1] >= '0' && c[1] <= '9') {
+            out.write(start, c - start);
+            // an argument straight after a quote is an attribute value
+            if (c > format && (c[-1] == '\'' || c[-1] == '"')) handleAs(tree.child(command, c[1] - '0'), TextMode::Attribute);
+            else handle(tree.child(command, c[1] - '0'));
+            ++c;
+            start = c + 1;
+        }
     }
-    out << "\n\n";
+    out << start;
 }
@@ -0,0 +1,174 @@
+#include <cstring>
+#include <ostream>
+#include <streambuf>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "latexwiki.h"
+
+// Every byte that may need more than copying in some mode. Most text has
+// none of them, so the writer looks for the next one as fast as it can and
+// copies everything before it in one go.
+static const char specialBytes[] = { '`', '\'', '-', '~', '<', '>', '&', '"', '\n' };
+
+struct SpecialTable {
+    SpecialTable() {
+        std::memset(isSpecial, 0, sizeof(isSpecial));
+        for (char c : specialBytes) isSpecial[static_cast<unsigned char>(c)] = true;
+    }
+    bool isSpecial[256];
+};
+static const SpecialTable specialTable;
+
+typedef std::size_t (*FindSpecialFunc)(const char *data, std::size_t pos, std::size_t size);
+
+static std::size_t findSpecialScalar(const char *data, std::size_t pos, std::size_t size) {
+    while (pos < size && !specialTable.isSpecial[static_cast<unsigned char>(data[pos])]) ++pos;
+    return pos;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static std::size_t findSpecialSse2(const char *data, std::size_t pos, std::size_t size) {
+    const __m128i quote = _mm_set1_epi8('`'), apostrophe = _mm_set1_epi8('\''), dash = _mm_set1_epi8('-');
+    const __m128i tilde = _mm_set1_epi8('~'), less = _mm_set1_epi8('<'), greater = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&'), doubleQuote = _mm_set1_epi8('"'), newline = _mm_set1_epi8('\n');
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i found = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, apostrophe)),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, dash), _mm_cmpeq_epi8(chunk, tilde))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, less), _mm_cmpeq_epi8(chunk, greater)),
+                         _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, doubleQuote)),
+                                      _mm_cmpeq_epi8(chunk, newline))));
+        unsigned mask = _mm_movemask_epi8(found);
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return findSpecialScalar(data, pos, size);
+}
+
+__attribute__((target("avx2")))
+static std::size_t findSpecialAvx2(const char *data, std::size_t pos, std::size_t size) {
+    const __m256i quote = _mm256_set1_epi8('`'), apostrophe = _mm256_set1_epi8('\''), dash = _mm256_set1_epi8('-');
+    const __m256i tilde = _mm256_set1_epi8('~'), less = _mm256_set1_epi8('<'), greater = _mm256_set1_epi8('>');
+    const __m256i amp = _mm256_set1_epi8('&'), doubleQuote = _mm256_set1_epi8('"'), newline = _mm256_set1_epi8('\n');
+    for (; pos + 32 <= size; pos += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i found = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, apostrophe)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, dash), _mm256_cmpeq_epi8(chunk, tilde))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, less), _mm256_cmpeq_epi8(chunk, greater)),
+                            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, amp), _mm256_cmpeq_epi8(chunk, doubleQuote)),
+                                            _mm256_cmpeq_epi8(chunk, newline))));
+        unsigned mask = _mm256_movemask_epi8(found);
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return findSpecialSse2(data, pos, size);
+}
+#endif
+
+static FindSpecialFunc chooseFindSpecial() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return findSpecialAvx2;
+    if (__builtin_cpu_supports("sse2")) return findSpecialSse2;
+#endif
+    return findSpecialScalar;
+}
+static const FindSpecialFunc findSpecial = chooseFindSpecial();
+
+static inline void put(std::streambuf *buf, const char *text, std::size_t size) {
+    buf->sputn(text, size);
+}
+
+template<std::size_t N>
+static inline void put(std::streambuf *buf, const char (&text)[N]) {
+    buf->sputn(text, N - 1);
+}
+
+// Write text as HTML in a single pass. Runs of whitespace containing a line
+// break become one space and <, > and & are always escaped. Prose also turns
+// TeX quotes, dashes and ties into entities; attribute values escape quotes
+// instead.
+void writeHtmlText(std::ostream &out, StringView text, TextMode mode) {
+    std::streambuf *buf = out.rdbuf();
+    const char *data = text.data;
+    const std::size_t size = text.size;
+    std::size_t start = 0, pos = 0;
+    while ((pos = findSpecial(data, pos, size)) < size) {
+        const char c = data[pos];
+        switch (c) {
+        case '\n': {
+            std::size_t runStart = pos, runEnd = pos + 1;
+            while (runStart > start && is_space(data[runStart - 1])) --runStart;
+            while (runEnd < size && is_space(data[runEnd])) ++runEnd;
+            put(buf, data + start, runStart - start);
+            put(buf, " ");
+            start = pos = runEnd;
+            continue; }
+        case '<':
+            put(buf, data + start, pos - start);
+            put(buf, "&lt;");
+            start = ++pos;
+            continue;
+        case '>':
+            put(buf, data + start, pos - start);
+            put(buf, "&gt;");
+            start = ++pos;
+            continue;
+        case '&':
+            put(buf, data + start, pos - start);
+            put(buf, "&amp;");
+            start = ++pos;
+            continue;
+        }
+
+        if (mode == TextMode::Attribute) {
+            if (c == '\'' || c == '"') {
+                put(buf, data + start, pos - start);
+                if (c == '\'') put(buf, "&#39;");
+                else put(buf, "&quot;");
+                start = pos + 1;
+            }
+            ++pos;
+            continue;
+        }
+        if (mode != TextMode::Prose) {
+            ++pos;
+            continue;
+        }
+
+        const bool doubled = pos + 1 < size && data[pos + 1] == c;
+        if (c == '`') {
+            put(buf, data + start, pos - start);
+            if (doubled) put(buf, "&ldquo;");
+            else put(buf, "&lsquo;");
+            pos += doubled ? 2 : 1;
+            start = pos;
+        } else if (c == '\'' && doubled) {
+            put(buf, data + start, pos - start);
+            put(buf, "&rdquo;");
+            start = pos += 2;
+        } else if (c == '-' && doubled) {
+            put(buf, data + start, pos - start);
+            if (pos + 2 < size && data[pos + 2] == '-') {
+                put(buf, "&mdash;");
+                pos += 3;
+            } else {
+                put(buf, "&ndash;");
+                pos += 2;
+            }
+            start = pos;
+        } else if (c == '~') {
+            put(buf, data + start, pos - start);
+            put(buf, "&nbsp;");
+            start = ++pos;
+        } else {
+            ++pos;
+        }
+    }
+    put(buf, data + start, size - start);
+}
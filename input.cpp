@@ -1,161 +1,298 @@
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 #include "latexwiki.h"
 
+unsigned maxNesting = 256;
+std::size_t maxSourceSize = 64 * 1024 * 1024;
+
 
-CommandInfo BADINFO = { "", 0, 0 };
-
-std::vector<CommandInfo> commandInfo = {
-    {   "pageinfo",         4, 4 },
-    {   "chapter",          1, 1 },
-    {   "section",          1, 1 },
-    {   "subsection",       1, 1 },
-    {   "subsubsection",    1, 1 },
-    {   "paragraph",        1, 1 },
-    {   "addlabel",         2, 2 },
-    {   "label",            1, 1 },
-    {   "pr",               1, 1 },
-    {   "pageref",          1, 1 },
-
-    {   "begin",            1, 99 },
-    {   "end",              1, 1 },
-    {   "item",             0, 1 },
-
-    {   "href",             2, 2 },
-    {   "url",              1, 1 },
-    {   "textbf",           1, 1 },
-    {   "emph",             1, 1 },
-    {   "nexustext",        1, 1 },
-    {   "vocab",            5, 5 },
-
-    {   "toprule",          0, 0 },
-    {   "midrule",          0, 0 },
-    {   "bottomrule",       0, 0 },
-    {   "captionof",        0, 0 },
-
-
-    {   "startorbittable",  0, 0 },
-    {   "stoporbittable",   0, 0 },
-    {   "planetrow",        5, 5 },
-    {   "moonrow",          2, 2 },
-
-    {   "startinfobox",     0, 0 },
-    {   "stopinfobox",      0, 0 },
-    {   "infotitle",        1, 1 },
-    {   "infoline",         2, 2 },
-    {   "infohead",         1, 1 },
-
-    {   "startdblinfobox",  0, 0 },
-    {   "stopdblinfobox",   0, 0 },
-    {   "dblinfotitle",     1, 1 },
-    {   "dblinfoline",      4, 4 },
-
-    {   "narrowimage",      2, 2 },
-    {   "mediumimage",      2, 2 },
-    {   "wideimage",        2, 2 },
-
-    {   "LaTeX",            0, 1 },
-    {   "degree",           0, 1 },
-    {   "times",            0, 1 },
-    {   "clearpage",        0, 0 },
-    {   "parbox",           2, 3 },
-    {   "textwidth",        0, 0 },
-    {   "linewidth",        0, 0 },
+const CommandInfo commandInfo[] = {
+    {   "",     0, 0,   nullptr },
+#define COMMAND_INFO(id, minArgs, maxArgs, format) { #id, minArgs, maxArgs, format },
+    COMMAND_TABLE(COMMAND_INFO)
+#undef COMMAND_INFO
 };
 
-const CommandInfo& getCommandInfo(const std::string &name) {
-    for (const CommandInfo &cinfo : commandInfo) {
-        if (cinfo.name == name) return cinfo;
+// FNV-1a, usable in constant expressions; matches hashBytes().
+static constexpr unsigned long long commandHash(const char *name, unsigned long long hash = HASH_SEED) {
+    return *name ? commandHash(name + 1, (hash ^ static_cast<unsigned char>(*name)) * 1099511628211ULL) : hash;
+}
+
+// Command names are resolved with a switch over their hashes, which the
+// compiler turns into a jump table or binary search; a hash collision between
+// two command names is a duplicate case label and fails to compile.
+CommandId lookupCommand(StringView name) {
+    switch (hashBytes(name.data, name.size)) {
+#define COMMAND_CASE(id, minArgs, maxArgs, format) \
+        case commandHash(#id): return name == #id ? CommandId::id : CommandId::Unknown;
+        COMMAND_TABLE(COMMAND_CASE)
+#undef COMMAND_CASE
     }
-    return BADINFO;
+    return CommandId::Unknown;
 }
 
-void forwardToNextArgument(const std::string &s, std::string::size_type &pos) {
-    std::string::size_type npos = pos;
-    while (npos < s.size() && s[npos] == ' ') ++npos;
-    if (npos > s.size()) return;
-    if (s[npos] == '{' || s[npos] == '[') pos = npos;
+const CommandInfo& getCommandInfo(CommandId id) {
+    return commandInfo[static_cast<unsigned>(id)];
 }
 
-bool processCommand(const std::string &sourceFile, const std::string &s, std::string::size_type &pos, Node *parent, ErrorLog &errorLog) {
-    ++pos;
-    std::string::size_type start = pos;
+SourceFile* SourceFile::open(const std::string &filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    SourceFile *file = new SourceFile;
+    file->data = "";
+    file->size = 0;
+    file->isMapped = false;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            file->data = static_cast<const char*>(mapping);
+            file->size = info.st_size;
+            file->isMapped = true;
+        }
+    }
+    if (!file->isMapped) {
+        // not a regular file or could not be mapped; read it instead
+        char chunk[65536];
+        ssize_t count;
+        while ((count = read(fd, chunk, sizeof(chunk))) > 0) {
+            file->buffer.append(chunk, count);
+        }
+        file->data = file->buffer.data();
+        file->size = file->buffer.size();
+    }
+    close(fd);
+    return file;
+}
 
-    if (pos >= s.size()) {
-        errorLog.add(ErrorType::Fatal, sourceFile, "Unexpected end of text.");
-        return false;
-    } else if (!is_identifier(s[pos])) {
-        parent->add(new Text(s.substr(pos, 1)));
-        ++pos;
-        return true;
+SourceFile::~SourceFile() {
+    if (isMapped) munmap(const_cast<char*>(data), size);
+}
+
+// Finding the bytes that give source text its structure: backslashes and
+// closing brackets. Everything between them is copied into text nodes as is.
+typedef std::size_t (*FindStructuralFunc)(const char *data, std::size_t pos, std::size_t size);
+
+static std::size_t findStructuralScalar(const char *data, std::size_t pos, std::size_t size) {
+    while (pos < size && data[pos] != '\\' && data[pos] != '}' && data[pos] != ']') ++pos;
+    return pos;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static std::size_t findStructuralSse2(const char *data, std::size_t pos, std::size_t size) {
+    const __m128i backslash = _mm_set1_epi8('\\'), brace = _mm_set1_epi8('}'), bracket = _mm_set1_epi8(']');
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, backslash),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, brace), _mm_cmpeq_epi8(chunk, bracket)));
+        unsigned mask = _mm_movemask_epi8(found);
+        if (mask) return pos + __builtin_ctz(mask);
     }
+    return findStructuralScalar(data, pos, size);
+}
 
-    while (pos < s.size() && is_identifier(s[pos])) ++pos;
-    Command *cmd = new Command;
-    if (!cmd) {
-        errorLog.add(ErrorType::Fatal, sourceFile, "Failed to allocate memory for command.");
-        return false;
+__attribute__((target("avx2")))
+static std::size_t findStructuralAvx2(const char *data, std::size_t pos, std::size_t size) {
+    const __m256i backslash = _mm256_set1_epi8('\\'), brace = _mm256_set1_epi8('}'), bracket = _mm256_set1_epi8(']');
+    for (; pos + 32 <= size; pos += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, backslash),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, brace), _mm256_cmpeq_epi8(chunk, bracket)));
+        unsigned mask = _mm256_movemask_epi8(found);
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return findStructuralSse2(data, pos, size);
+}
+#endif
+
+static FindStructuralFunc chooseFindStructural() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return findStructuralAvx2;
+    if (__builtin_cpu_supports("sse2")) return findStructuralSse2;
+#endif
+    return findStructuralScalar;
+}
+static const FindStructuralFunc findStructural = chooseFindStructural();
+
+// Move pos to the start of the next argument of a command if only spaces (or
+// whitespace including a line break, which stands for a single space)
+// separate it from pos.
+static void forwardToNextArgument(StringView s, std::size_t &pos) {
+    std::size_t npos = pos;
+    bool lineBreak = false, onlySpaces = true;
+    while (npos < s.size && is_space(s.data[npos])) {
+        if (s.data[npos] == '\n') lineBreak = true;
+        else if (s.data[npos] != ' ') onlySpaces = false;
+        ++npos;
     }
-    parent->add(cmd);
+    if (npos >= s.size || (!lineBreak && !onlySpaces)) return;
+    if (s.data[npos] == '{' || s.data[npos] == '[') pos = npos;
+}
+
+// An argument being parsed, or the paragraph itself at the bottom of the
+// stack. Nodes are only ever added at the end of the article's node list, so
+// the frame needs just the indexes of the command and of the argument's
+// fragment node.
+struct ParseFrame {
+    // both noNode for the paragraph
+    unsigned command, argument;
+    char endChar;
+};
+
+static void addText(std::vector<Node> &nodes, const char *base, const char *text, std::size_t size, NodeKind kind = NodeKind::Text) {
+    const unsigned index = nodes.size();
+    nodes.push_back(Node{kind, 0, CommandId::Unknown, index + 1,
+                         size ? static_cast<unsigned>(text - base) : 0, static_cast<unsigned>(size)});
+}
+
+// Finish a command that takes no more arguments, and check its argument count
+// against the command table.
+static void closeCommand(const std::string &sourceFile, std::vector<Node> &nodes, unsigned cmd, const char *base, ErrorLog &errorLog) {
+    nodes[cmd].next = nodes.size();
+    int argCount = 0;
+    for (unsigned c = cmd + 1; c < nodes.size(); c = nodes[c].next) ++argCount;
+
+    const CommandInfo &cinfo = getCommandInfo(nodes[cmd].id);
+    if (nodes[cmd].id != CommandId::Unknown && (argCount < cinfo.minArgs || argCount > cinfo.maxArgs)) {
+        std::stringstream msg;
+        msg << "Command " << std::string(base + nodes[cmd].textStart, nodes[cmd].textSize) << " expects " << cinfo.minArgs;
+        if (cinfo.minArgs != cinfo.maxArgs) msg << " to " << cinfo.maxArgs;
+        msg << " argument(s), but found " << argCount << ".";
+
+        errorLog.add(ErrorType::Error, sourceFile, msg.str());
+    }
+}
 
-    cmd->command = s.substr(start, pos - start);
-    const CommandInfo &cinfo = getCommandInfo(cmd->command);
-    if (cinfo.name.empty()) {
-        errorLog.add(ErrorType::Warning, sourceFile, "Unknown command " + cmd->command + ".");
+// Finish an argument. An argument made of a single node is replaced by that
+// node, which moves the nodes after it down by one.
+static void closeArgument(std::vector<Node> &nodes, unsigned argument) {
+    const unsigned end = nodes.size();
+    if (nodes[argument + 1].next == end) {
+        for (unsigned i = argument + 1; i < end; ++i) {
+            nodes[i - 1] = nodes[i];
+            --nodes[i - 1].next;
+        }
+        nodes.pop_back();
+    } else {
+        nodes[argument].next = end;
     }
+}
 
-    forwardToNextArgument(s, pos);
-    while (pos < s.size() && (s[pos] == '{' || s[pos] == '[')) {
-        char endChar = s[pos] == '{' ? '}' : ']';
-        Fragment *f = new Fragment;
-        if (!f) {
-            errorLog.add(ErrorType::Fatal, sourceFile, "Failed to allocate memory for fragment.");
-            return false;
+// Parse one paragraph, adding its nodes to the end of nodes. Arguments are
+// tracked on an explicit stack rather than by recursion, so deeply nested
+// input cannot exhaust the call stack; nesting beyond maxNesting is an error
+// instead. Inside an argument only a backslash and the argument's own closing
+// bracket mean anything; other brackets are ordinary text.
+static bool parseParagraph(const std::string &sourceFile, const char *base, StringView s, std::vector<Node> &nodes, std::vector<ParseFrame> &stack, ErrorLog &errorLog) {
+    const unsigned paragraph = nodes.size();
+    nodes.push_back(Node{NodeKind::Paragraph, 0, CommandId::Unknown, 0, 0, 0});
+    stack.clear();
+    stack.push_back(ParseFrame{noNode, noNode, 0});
+    std::size_t start = 0, pos = 0;
+    while (true) {
+        const ParseFrame &frame = stack.back();
+        const bool inArgument = frame.command != noNode;
+        while (pos < s.size) {
+            pos = findStructural(s.data, pos, s.size);
+            if (pos >= s.size || s.data[pos] == '\\' || (inArgument && s.data[pos] == frame.endChar)) break;
+            ++pos;
         }
 
-        ++pos;
-        start = pos;
-        while (pos < s.size() && s[pos] != endChar) {
-            if (s[pos] == '\\') {
-                if (pos > start) {
-                    f->add(new Text(s.substr(start, pos - start)));
+        unsigned cmd = noNode;
+        if (pos < s.size && s.data[pos] == '\\') {
+            if (pos > start) {
+                addText(nodes, base, s.data + start, pos - start);
+            }
+            ++pos;
+            if (pos >= s.size) {
+                errorLog.add(ErrorType::Fatal, sourceFile, "Unexpected end of text.");
+                return false;
+            } else if (!is_identifier(s.data[pos])) {
+                // an escaped line break stands for a single space, along with
+                // any indentation following it
+                std::size_t end = pos + 1;
+                if (is_space(s.data[pos])) {
+                    while (end < s.size && is_space(s.data[end])) ++end;
+                    if (std::memchr(s.data + pos, '\n', end - pos) == nullptr) end = pos + 1;
                 }
-                if (!processCommand(sourceFile, s, pos, f, errorLog)) return false;
-                start = pos;
-            } else {
-                ++pos;
+                addText(nodes, base, s.data + pos, end - pos, NodeKind::EscapedText);
+                start = pos = end;
+                continue;
             }
-        }
-        if (pos > start) {
-            f->add(new Text(s.substr(start, pos - start)));
+
+            std::size_t nameStart = pos;
+            while (pos < s.size && is_identifier(s.data[pos])) ++pos;
+            const StringView name(s.data + nameStart, pos - nameStart);
+            cmd = nodes.size();
+            nodes.push_back(Node{NodeKind::Command, 0, lookupCommand(name), 0,
+                                 static_cast<unsigned>(name.data - base), static_cast<unsigned>(name.size)});
+            if (nodes[cmd].id == CommandId::Unknown) {
+                errorLog.add(ErrorType::Warning, sourceFile, "Unknown command " + name.str() + ".");
+            }
+        } else if (!inArgument) {
+            // the end of the paragraph
+            if (pos > start) {
+                addText(nodes, base, s.data + start, pos - start);
+            }
+            nodes[paragraph].next = nodes.size();
+            return true;
         } else {
-            f->add(new Text(""));
+            // the end of an argument, or of the text with the argument still
+            // open; an argument always holds at least one node
+            if (pos > start) {
+                addText(nodes, base, s.data + start, pos - start);
+            } else {
+                addText(nodes, base, nullptr, 0);
+            }
+            ++pos;
+            cmd = frame.command;
+            closeArgument(nodes, frame.argument);
+            stack.pop_back();
         }
 
-        ++pos;
+        // cmd may take another argument here
         forwardToNextArgument(s, pos);
-        cmd->add(f);
-    }
-
-    if (!cinfo.name.empty() && (cmd->size() < cinfo.minArgs || cmd->size() > cinfo.maxArgs)) {
-        std::stringstream msg;
-        msg << "Command " << cmd->command << " expects " << cinfo.minArgs;
-        if (cinfo.minArgs != cinfo.maxArgs) msg << " to " << cinfo.maxArgs;
-        msg << " argument(s), but found " << cmd->size() << ".";
-
-        errorLog.add(ErrorType::Error, sourceFile, msg.str());
+        if (pos < s.size && (s.data[pos] == '{' || s.data[pos] == '[')) {
+            if (stack.size() > maxNesting) {
+                std::stringstream msg;
+                msg << "Commands are nested more than " << maxNesting << " deep.";
+                errorLog.add(ErrorType::Fatal, sourceFile, msg.str());
+                return false;
+            }
+            const unsigned argument = nodes.size();
+            nodes.push_back(Node{NodeKind::Fragment, 0, CommandId::Unknown, 0, 0, 0});
+            stack.push_back(ParseFrame{cmd, argument, s.data[pos] == '{' ? '}' : ']'});
+            ++pos;
+        } else {
+            closeCommand(sourceFile, nodes, cmd, base, errorLog);
+        }
+        start = pos;
     }
-
-    return true;
 }
 
-Article* processFile(const std::string &sourceFile, ErrorLog &errorLog) {
+Article* processFile(const std::string &sourceFile, ErrorLog &errorLog, unsigned long long sourceHash, SourceFile *source) {
     if (sourceFile.size() <= 4 || sourceFile.substr(sourceFile.size() - 4) != ".tex") {
         errorLog.add(ErrorType::Fatal, sourceFile, "Unknown input file format.");
+        delete source;
         return nullptr;
     }
     std::string::size_type start = sourceFile.find_last_of('/');
@@ -163,52 +300,103 @@ Article* processFile(const std::string &sourceFile, ErrorLog &errorLog) {
     else ++start;
     const std::string dest = sourceFile.substr(start, sourceFile.size() - 3 - start) + "html";
 
-    std::ifstream inf(sourceFile);
-    if (!inf) {
-        errorLog.add(ErrorType::Fatal, sourceFile, "Could not open file for reading.");
+    Article *article = new Article;
+    article->sourceFile = sourceFile;
+    article->filename = dest;
+    article->sourceHash = sourceHash;
+    if (!loadArticle(article, errorLog, source)) {
+        delete article;
         return nullptr;
     }
+    return article;
+}
 
-    std::vector<std::string> paragraphs;
-    std::string line, current;
-    while (std::getline(inf, line)) {
-        trim(line);
-        if (line.empty()) {
-            if (!current.empty()) {
-                paragraphs.push_back(current);
-                current.clear();
-            }
+// Split source text into paragraphs at blank lines. Each paragraph is a view
+// into the source with its surrounding whitespace removed; the line breaks
+// inside it are left for the parser and output to treat as spaces.
+static std::vector<StringView> splitParagraphs(const char *data, std::size_t size) {
+    std::vector<StringView> paragraphs;
+    std::size_t start = 0, end = 0;
+    bool inParagraph = false;
+    for (std::size_t pos = 0; pos < size; ) {
+        const char *newline = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+        std::size_t lineEnd = newline ? newline - data : size;
+
+        std::size_t first = pos, last = lineEnd;
+        while (first < last && is_space(data[first])) ++first;
+        while (last > first && is_space(data[last - 1])) --last;
+        if (first == last) {
+            if (inParagraph) paragraphs.push_back(StringView(data + start, end - start));
+            inParagraph = false;
         } else {
-            if (!current.empty()) current += ' ';
-            current += line;
+            if (!inParagraph) start = first;
+            end = last;
+            inParagraph = true;
         }
+        pos = lineEnd + 1;
     }
-    if (!current.empty()) paragraphs.push_back(current);
-
-    Article *article = new Article;
-    article->sourceFile = sourceFile;
-    article->filename = dest;
-    for (const std::string &s : paragraphs) {
-        std::string::size_type start = 0, pos = 0;
-        Paragraph *p = new Paragraph;
-
-        for (pos = 0; pos < s.size(); ) {
-            if (s[pos] == '\\') {
-                if (pos > start) {
-                    p->add(new Text(s.substr(start, pos - start)));
-                }
-                if (!processCommand(sourceFile, s, pos, p, errorLog)) return nullptr;
-                start = pos;
-            } else {
-                ++pos;
-            }
-        }
-        if (pos != start) {
-            p->add(new Text(s.substr(start, pos - start)));
-        }
+    if (inParagraph) paragraphs.push_back(StringView(data + start, end - start));
+    return paragraphs;
+}
 
-        article->add(p);
+// Parse the text of an article's source file into its syntax tree. The
+// source stays mapped for as long as the article exists, since the nodes
+// refer to it directly. When the hash of the source is already known, the
+// nodes saved by an earlier build for the same text are used instead. The
+// source can be given already opened, as when the scan has just hashed it;
+// the article takes it over either way.
+bool loadArticle(Article *article, ErrorLog &errorLog, SourceFile *source) {
+    const std::string &sourceFile = article->sourceFile;
+    TraceSpan span("article", "parse", sourceFile);
+    // a source given already open was hashed into sourceHash from the same
+    // mapping
+    const bool sourceHashed = source != nullptr;
+    if (!source) source = SourceFile::open(sourceFile);
+    if (!source) {
+        errorLog.add(ErrorType::Fatal, sourceFile, "Could not open file for reading.");
+        return false;
     }
+    if (source->size > maxSourceSize) {
+        std::stringstream msg;
+        msg << "File is " << source->size << " bytes, more than the limit of " << maxSourceSize << ".";
+        errorLog.add(ErrorType::Fatal, sourceFile, msg.str());
+        delete source;
+        return false;
+    }
+    if (useAstCache && !fullRebuild && article->sourceHash != 0 && loadCachedArticle(article, source, sourceHashed, errorLog)) {
+        return true;
+    }
+    delete article->source;
+    article->source = source;
+    delete article->cachedTree;
+    article->cachedTree = nullptr;
+    article->tree.clear();
+    article->sourceSize = source->size;
+
+    const std::size_t firstMessage = errorLog.errors.size();
+    // Each thread builds its trees in the same buffer, which soon stops
+    // growing; the finished tree is copied into the article's arena.
+    static thread_local std::vector<Node> nodes;
+    nodes.clear();
+    nodes.reserve(source->size / 32 + 16);
+    std::vector<ParseFrame> stack;
+    for (StringView s : splitParagraphs(source->data, source->size)) {
+        if (!parseParagraph(sourceFile, source->data, s, nodes, stack, errorLog)) return false;
+    }
+    article->tree.setNodes(nodes, source->data);
 
-    return article;
+    article->isLoaded = true;
+    if (useAstCache) saveCachedArticle(article, errorLog, firstMessage, sourceHashed);
+    return true;
+}
+
+// Free an article's tree and source text, keeping everything the scan
+// recorded about it. loadArticle() brings them back if it is rendered again.
+void unloadArticle(Article *article) {
+    article->tree.clear();
+    delete article->source;
+    article->source = nullptr;
+    delete article->cachedTree;
+    article->cachedTree = nullptr;
+    article->isLoaded = false;
 }
@@ -1,57 +1,21 @@
-#include <algorithm>
-#include <chrono>
-#include <ctime>
-#include <fstream>
+#include <cstdlib>
 #include <iostream>
-#include <sstream>
 #include <string>
 
 #include "latexwiki.h"
 
 bool showMissingWorld = false;
 bool showMissingCategory = false;
+bool showOrphans = false;
 bool hideWarnings = false;
-
-void dumpErrors(const ErrorLog &errorLog, bool hideWarnings) {
-    for (const ErrorMsg &msg : errorLog.errors) {
-        if (hideWarnings && msg.type == ErrorType::Warning) continue;
-        switch (msg.type) {
-            case ErrorType::Fatal:      std::cerr << "FATAL  "; break;
-            case ErrorType::Error:      std::cerr << "ERROR  "; break;
-            case ErrorType::Warning:    std::cerr << "WARN   "; break;
-        }
-        std::cerr << msg.sourceFile << ": " << msg.message << "\n";
-    }
-    std::cerr << "Warnings: " << errorLog.warnCount << "; errors: " << errorLog.errorCount << "; fatals: " << errorLog.fatalCount << ".\n";
-}
-
-
-std::string makeNavBar(const std::vector<Article*> &list, const std::string &navName, const std::string &navCurrent, Article *current) {
-    std::stringstream worldListString;
-    auto listPos = std::find(list.begin(), list.end(), current);
-    if (listPos != list.end()) {
-        worldListString << navName << ": <span class='navtype'>" << navCurrent << "</span> ";
-        if (listPos != list.begin()) {
-            Article *prev = *(listPos - 1);
-            worldListString << "&lt;&lt; <a href='";
-            worldListString << prev->filename;
-            worldListString << "'>";
-            worldListString << prev->name;
-            worldListString << "</a> | ";
-        }
-        worldListString << current->name;
-        if (listPos + 1 != list.end()) {
-            Article *prev = *(listPos + 1);
-            worldListString << " | <a href='";
-            worldListString << prev->filename;
-            worldListString << "'>";
-            worldListString << prev->name;
-            worldListString << "</a> &gt;&gt;";
-        }
-    }
-    return worldListString.str();
-}
-
+bool fullRebuild = false;
+bool useUring = true;
+bool watchMode = false;
+std::string traceFile;
+bool showStats = false;
+bool lowMemory = false;
+bool noSearch = false;
+int servePort = 0;
 
 int main(int argc, const char **argv) {
     std::string filelist;
@@ -60,13 +24,72 @@ int main(int argc, const char **argv) {
         std::string arg = argv[i];
         if (arg == "-noworld") showMissingWorld = true;
         else if (arg == "-nocategory") showMissingCategory = true;
+        else if (arg == "-orphans") showOrphans = true;
         else if (arg == "-hidewarnings") hideWarnings = true;
+        else if (arg == "-rebuild") fullRebuild = true;
+        else if (arg == "-nouring") useUring = false;
+        else if (arg == "-nocache") useAstCache = false;
+        else if (arg == "-compress") compressOutput = true;
+        else if (arg == "-watch") watchMode = true;
+        else if (arg == "-stats") showStats = true;
+        else if (arg == "-lowmem") lowMemory = true;
+        else if (arg == "-nosearch") noSearch = true;
+        else if (arg == "-trace") {
+            if (i + 1 >= argc) {
+                std::cerr << "-trace requires a file name.\n";
+                return 1;
+            }
+            traceFile = argv[++i];
+        }
+        else if (arg == "-serve") {
+            if (i + 1 >= argc || std::atoi(argv[i + 1]) <= 0 || std::atoi(argv[i + 1]) > 65535) {
+                std::cerr << "-serve requires a port number.\n";
+                return 1;
+            }
+            servePort = std::atoi(argv[++i]);
+        }
+        else if (arg == "-maxdepth") {
+            if (i + 1 >= argc || std::atoi(argv[i + 1]) <= 0) {
+                std::cerr << "-maxdepth requires a positive number.\n";
+                return 1;
+            }
+            maxNesting = std::atoi(argv[++i]);
+        }
+        else if (arg == "-maxsize") {
+            // text offsets in the syntax tree are 32 bits
+            if (i + 1 >= argc || std::atoll(argv[i + 1]) <= 0 || std::atoll(argv[i + 1]) > 0xFFFFFFFFLL) {
+                std::cerr << "-maxsize requires a positive number of bytes below 4 GB.\n";
+                return 1;
+            }
+            maxSourceSize = std::atoll(argv[++i]);
+        }
+        else if (arg == "-j") {
+            if (i + 1 >= argc || std::atoi(argv[i + 1]) <= 0) {
+                std::cerr << "-j requires a positive number of jobs.\n";
+                return 1;
+            }
+            jobCount = std::atoi(argv[++i]);
+        }
         else if (arg == "-help") {
             std::cerr << "USAGE: convert [-noworld] -[nocategory] [project file]\n\n";
             std::cerr << "-nohelp         Show this information\n";
             std::cerr << "-noworld        Show articles with no set world\n";
             std::cerr << "-nocategory     Show articles with no set category\n";
+            std::cerr << "-orphans        Show articles no other article refers to\n";
             std::cerr << "-hidewarnings   Hide generated warnings\n";
+            std::cerr << "-j N            Use N worker threads\n";
+            std::cerr << "-rebuild        Ignore the last build and rebuild every page\n";
+            std::cerr << "-nouring        Write output with a thread pool instead of io_uring\n";
+            std::cerr << "-nocache        Parse every source instead of using the trees cached in out/.astcache\n";
+            std::cerr << "-compress       Also write .gz (and .zst) copies of every page for servers that send them as is\n";
+            std::cerr << "-lowmem         Keep only the articles being worked on in memory, for very large projects\n";
+            std::cerr << "-nosearch       Skip collecting the words of each page and writing the search index\n";
+            std::cerr << "-watch          Keep running and rebuild when source files change\n";
+            std::cerr << "-serve PORT     Serve a preview of the pages on PORT instead of writing them\n";
+            std::cerr << "-maxdepth N     Allow commands to be nested at most N deep (256)\n";
+            std::cerr << "-maxsize N      Refuse source files larger than N bytes (64 MB)\n";
+            std::cerr << "-trace FILE     Write a Chrome trace of the build to FILE\n";
+            std::cerr << "-stats          Show the slowest articles and the time spent on each command\n";
             return 0;
         } else if (arg[0] == '-') {
             std::cerr << "Unrecognized argument " << arg << "; run \"convert -help\" for instructions.\n";
@@ -82,114 +105,25 @@ int main(int argc, const char **argv) {
     }
     if (filelist.empty()) filelist = "files.lst";
 
-    Document document;
-    document.graphicsPath = "./";
-    ErrorLog errorLog;
-    ScanDocument scanner(&document);
-    const std::string front = readFile("templates/front.html");
-    const std::string back = readFile("templates/back.html");
-
-    std::chrono::milliseconds scanStart = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-    std::ifstream files(filelist);
-    if (!files) {
-        std::cerr << "Failed to open project file " << filelist << ".\n";
-        return 1;
-    }
-    std::string filename;
-    std::cerr << "SCANNING FILES...\n";
-    while (std::getline(files, filename)) {
-        trim(filename);
-        if (filename.empty()) continue;
-        if (filename[0] == '#') continue;
-
-        Article *a = processFile(filename, errorLog);
-        if (!a) continue;
-
-        scanner.article = a;
-        scanner.errorLog = &errorLog;
-        a->process(scanner);
-        if (!a->hasPageInfo) {
-            errorLog.add(ErrorType::Warning, filename, "Article is missing page info.");
-        }
-
-        document.articles.push_back(a);
-    }
-    files.close();
-    std::chrono::milliseconds scanEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-    std::cerr << "Completed in " << (scanEnd - scanStart).count() << " ms.\n\n";
-
-    if (errorLog.hasErrors()) {
-        dumpErrors(errorLog, hideWarnings);
-        return 1;
-    }
-
-
-    std::chrono::milliseconds writeStart = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-    std::cerr << "WRITING FILES...\n";
-    for (Article *article : document.articles) {
-        // std::cerr << '[' << article->filename << "]\n";
-
-        const std::string realFilename = "out/" + article->filename;
-        std::ofstream outf(realFilename);
-        if (!outf) {
-            std::cerr << "Failed to open output file " << realFilename << "\n";
-            continue;
+    tracing = showStats || !traceFile.empty();
+    Builder builder(filelist);
+    builder.traceFile = traceFile;
+    builder.showStats = showStats;
+    builder.lowMemory = lowMemory;
+    builder.searchIndex = !noSearch;
+    if (!builder.loadProject()) return 1;
+    builder.loadTemplates();
+    if (servePort) {
+        if (watchMode) {
+            std::cerr << "-serve and -watch cannot be used together.\n";
+            return 1;
         }
-
-        time_t rawtime;
-        struct tm *timeinfo;
-        char buffer[80];
-        time (&rawtime);
-        timeinfo = localtime(&rawtime);
-        strftime(buffer, sizeof(buffer), "%b %d, %Y", timeinfo);
-
-        std::string newFront = front;
-        replaceText(newFront, "%TITLE%", article->name);
-        if (!article->category.empty()) replaceText(newFront, "%CATNAV%", makeNavBar(document.categories[article->category], "Category", article->category, article));
-         else                           replaceText(newFront, "%CATNAV%", "");
-        if (!article->category.empty()) replaceText(newFront, "%WORLDNAV%", makeNavBar(document.worlds[article->world], "World", article->world, article));
-        else                            replaceText(newFront, "%WORLDNAV%", "");
-
-        std::string newBack = back;
-        replaceText(newBack, "%GENTIME%", buffer);
-
-        outf << newFront;
-        FormatDocument dd(&document, outf);
-        dd.errorLog = &errorLog;
-        dd.article = article;
-        article->process(dd);
-        outf << newBack;
-    }
-    std::chrono::milliseconds writeEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-    std::cerr << "Completed in " << (writeEnd - writeStart).count() << " ms.\n\n";
-
-    if (errorLog.hasErrors()) {
-        dumpErrors(errorLog, hideWarnings);
-        return 1;
-    }
-
-    std::chrono::milliseconds indexesStart = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-    std::cerr << "WRITING INDEXES...\n";
-    make_indexes(front, back, document);
-    std::chrono::milliseconds indexesEnd = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-    std::cerr << "Completed in " << (indexesEnd - indexesStart).count() << " ms.\n\n";
-
-    if (errorLog.hasErrors()) {
-        dumpErrors(errorLog, hideWarnings);
-        return 1;
-    }
-
-
-    std::ofstream linkFile("links.lst");
-    for (auto iter : document.links) {
-        linkFile << iter.first << " :: " << iter.second.name << "/" << iter.second.targetPage << "/" << iter.second.isFragment << "\n";
+        return serveProject(builder, servePort);
     }
-    linkFile.close();
-
-    if (!errorLog.isEmpty()) {
-        dumpErrors(errorLog, hideWarnings);
+    if (watchMode) {
+        builder.keepResident = true;
+        builder.build();
+        return watchProject(builder);
     }
-    std::cerr << "Total runtime: " << ((scanEnd - scanStart) + (writeEnd - writeStart) + (indexesStart - indexesEnd)).count() << " ms.\n";
-
-    return 0;
+    return builder.build();
 }
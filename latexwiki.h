@@ -1,135 +1,619 @@
 #ifndef CONVERT_H
+#define CONVERT_H
 
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iosfwd>
 #include <map>
+#include <mutex>
+#include <new>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
-struct Node;
-struct Fragment;
-struct Text;
-struct Command;
-struct Paragraph;
 struct Article;
 struct Document;
+struct SearchTerms;
 struct ErrorLog;
 
-struct DocumentProcessor {
-    virtual void handle(Node*) = 0;
-    virtual void handle(Fragment*) = 0;
-    virtual void handle(Text*) = 0;
-    virtual void handle(Command*) = 0;
-    virtual void handle(Paragraph*) = 0;
+// A non-owning view of characters, normally inside an article's source file
+// mapping.
+struct StringView {
+    StringView()
+    : data(""), size(0)
+    { }
+    StringView(const char *data, std::size_t size)
+    : data(data), size(size)
+    { }
+
+    std::string str() const {
+        return std::string(data, size);
+    }
+    bool operator==(const char *text) const {
+        return std::strlen(text) == size && std::memcmp(data, text, size) == 0;
+    }
+    bool operator!=(const char *text) const {
+        return !(*this == text);
+    }
+
+    const char *data;
+    std::size_t size;
+};
 
-    Article *article;
-    ErrorLog *errorLog;
+// The contents of a source file, memory mapped when possible.
+struct SourceFile {
+    static SourceFile* open(const std::string &filename);
+    ~SourceFile();
+
+    const char *data;
+    std::size_t size;
+    bool isMapped;
+    std::string buffer;
 };
 
-struct DumpDocument : public DocumentProcessor {
-    DumpDocument(std::ostream &out);
-    virtual void handle(Node*);
-    virtual void handle(Fragment*);
-    virtual void handle(Text*);
-    virtual void handle(Command*);
-    virtual void handle(Paragraph*);
+// Every command the parser knows: its name, the number of arguments it
+// takes, and how it is written to HTML. %0 to %9 in the output format write
+// the corresponding argument. Commands with no format write their arguments
+// unchanged, unless FormatDocument handles them itself.
+#define COMMAND_TABLE(X) \
+    X(pageinfo,         4, 4,   "") \
+    X(chapter,          1, 1,   "<h2>%0</h2>") \
+    X(section,          1, 1,   "<h2>%0</h2>") \
+    X(subsection,       1, 1,   "<h3>%0</h3>") \
+    X(subsubsection,    1, 1,   "<h4>%0</h4>") \
+    X(paragraph,        1, 1,   "<span class='parahead'>%0</span>") \
+    X(addlabel,         2, 2,   nullptr) \
+    X(label,            1, 1,   nullptr) \
+    X(pr,               1, 1,   nullptr) \
+    X(pageref,          1, 1,   nullptr) \
+    \
+    X(begin,            1, 99,  nullptr) \
+    X(end,              1, 1,   nullptr) \
+    X(item,             0, 1,   nullptr) \
+    \
+    X(href,             2, 2,   "<a href='%0'>%1</a>") \
+    X(url,              1, 1,   nullptr) \
+    X(textbf,           1, 1,   "<b>%0</b>") \
+    X(emph,             1, 1,   "<i>%0</i>") \
+    X(nexustext,        1, 1,   "<span class='nexustext'>%0</span>") \
+    X(vocab,            5, 5,   "<p><span class='nexustext'>%1</span> <b>%0</b> %2 <i>%3.</i> %4</p>") \
+    \
+    X(toprule,          0, 0,   nullptr) \
+    X(midrule,          0, 0,   nullptr) \
+    X(bottomrule,       0, 0,   nullptr) \
+    X(captionof,        0, 0,   nullptr) \
+    \
+    X(startorbittable,  0, 0,   "<table class='orbittable'>\n<tr><th>Orbit</th><th>Radius (AU)</th><th>Type</th><th>BB Temp (K)</th><th>Moonlets</th>\n") \
+    X(stoporbittable,   0, 0,   "</table>\n") \
+    X(planetrow,        5, 5,   "<tr class='planet'><td>%0</td><td>%1</td><td>%2</td><td>%3</td><td>%4</td></tr>\n") \
+    X(moonrow,          2, 2,   "<tr class='moon'><td>%0</td><td></td><td>%1</td></tr>\n") \
+    \
+    X(startinfobox,     0, 0,   "<table class='infobox'>") \
+    X(stopinfobox,      0, 0,   "</table>") \
+    X(infotitle,        1, 1,   "<tr><td colspan='2' class='infotitle'>%0</td></tr>") \
+    X(infoline,         2, 2,   "<tr><td class='infoleft'>%0</td><td class='inforight'>%1</td></tr>") \
+    X(infohead,         1, 1,   "<tr><td colspan='2' class='infohead'>%0</td></tr>") \
+    \
+    X(startdblinfobox,  0, 0,   "<table class='dblinfobox'>") \
+    X(stopdblinfobox,   0, 0,   "</table>") \
+    X(dblinfotitle,     1, 1,   "<tr><td colspan='4' class='dblinfotitle'>%0</td></tr>") \
+    X(dblinfoline,      4, 4,   "<tr><td class='dblinfoleft'>%0</td><td class='dblinforight'>%1</td><td class='dblinfoleft'>%2</td><td class='dblinforight'>%3</td></tr>") \
+    \
+    X(narrowimage,      2, 2,   nullptr) \
+    X(mediumimage,      2, 2,   nullptr) \
+    X(wideimage,        2, 2,   nullptr) \
+    \
+    X(LaTeX,            0, 1,   "LaTeX") \
+    X(degree,           0, 1,   "&deg;") \
+    X(times,            0, 1,   "&times;") \
+    X(clearpage,        0, 0,   "") \
+    X(parbox,           2, 3,   "%1") \
+    X(textwidth,        0, 0,   "") \
+    X(linewidth,        0, 0,   "")
+
+enum class CommandId : unsigned short {
+    Unknown,
+#define COMMAND_ID(id, minArgs, maxArgs, format) id,
+    COMMAND_TABLE(COMMAND_ID)
+#undef COMMAND_ID
+    Count
+};
 
-    std::ostream &out;
-    int depth;
+// How text is written to HTML: prose gets TeX quotes, dashes and ties turned
+// into entities, literal text is only escaped, and attribute values also
+// have their quotes escaped.
+enum class TextMode {
+    Prose, Literal, Attribute
+};
+
+enum class NodeKind : unsigned char {
+    Paragraph,
+    Fragment,       // an argument made of more than one node
+    Command,        // its children are its arguments
+    Text,
+    // text written from a backslash escape such as \&, so it is never
+    // treated as TeX punctuation
+    EscapedText
+};
+
+// One node of an article's syntax tree. The nodes of an article are kept in a
+// single array in document order, each followed by its descendants: the first
+// child of a node is the one right after it, and next is the index of its
+// next sibling, which is also one past the end of its subtree. The same
+// layout is stored in the AST cache.
+struct Node {
+    NodeKind kind;
+    unsigned char unused;
+    CommandId id;
+    unsigned next;
+    // the text of a text node or the name of a command, as an offset into
+    // the article's text
+    unsigned textStart, textSize;
+};
+
+// Returned for a child that does not exist.
+const unsigned noNode = ~0u;
+
+// Bump allocator for data that lives exactly as long as its owner, such as
+// the nodes of an article. Everything is released at once when the arena is
+// cleared or destroyed; destructors of the objects it holds are never run.
+// An allocation larger than blockSize gets a block of its own, so an arena
+// with a blockSize of 0 wastes nothing on owners that allocate once.
+struct Arena {
+    Arena(std::size_t blockSize = 64 * 1024);
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(std::size_t size, std::size_t align);
+    void clear();
+    template<class T, class... Args>
+    T* make(Args&&... args) {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    std::size_t blockSize;
+    std::vector<char*> blocks;
+    char *next;
+    std::size_t remaining;
+};
+
+// The nodes of an article and the text they refer to, either built by the
+// parser or mapped from the AST cache. Text nodes refer directly to the source
+// text, which may still contain the line breaks and indentation of the
+// original file. Any run of whitespace that includes a line break stands for
+// a single space.
+struct SyntaxTree {
+    SyntaxTree();
+    void clear();
+    void setNodes(const std::vector<Node> &built, const char *textBase);
+    void setNodes(const Node *mapped, unsigned mappedCount, const char *textBase);
+    unsigned childCount(unsigned node) const;
+    unsigned child(unsigned node, unsigned n) const;
+    std::string str(unsigned node) const;
+
+    bool isText(unsigned node) const {
+        return node != noNode && (nodes[node].kind == NodeKind::Text || nodes[node].kind == NodeKind::EscapedText);
+    }
+    StringView text(unsigned node) const {
+        return nodes[node].textSize ? StringView(textBase + nodes[node].textStart, nodes[node].textSize) : StringView();
+    }
+
+    const Node *nodes;
+    unsigned count;
+    const char *textBase;
+    // holds the nodes built by the parser; empty when they are mapped
+    Arena arena;
+};
+
+// A pass over the nodes of an article. Passes walk the tree themselves,
+// switching on the kind of each node, and are run over each paragraph by
+// Article::process().
+struct DocumentProcessor {
+    DocumentProcessor();
+
+    Article *article;
+    ErrorLog *errorLog;
 };
 
 struct FormatDocument : public DocumentProcessor {
     FormatDocument(Document *article, std::ostream &out);
-    virtual void handle(Node*);
-    virtual void handle(Fragment*);
-    virtual void handle(Text*);
-    virtual void handle(Command*);
-    virtual void handle(Paragraph*);
+    void handle(unsigned node);
+    void handleChildren(unsigned node);
+    void handleCommand(unsigned command);
+    void handleFormat(unsigned command, const char *format);
+    void handleAs(unsigned node, TextMode mode);
 
     std::ostream &out;
     Document *document;
+    // how text is written; Prose except inside attribute values and
+    // verbatim text such as URLs
+    TextMode textMode;
+    // where the words of the article go, if anywhere, and how much the
+    // words being written count for
+    SearchTerms *searchTerms;
+    unsigned searchWeight;
 };
 
+// Records an article's labels, references, images and page info. With no
+// document, only the article is updated; replayScan() applies the rest to a
+// document later.
 struct ScanDocument : public DocumentProcessor {
     ScanDocument(Document *article);
-    virtual void handle(Node*);
-    virtual void handle(Fragment*);
-    virtual void handle(Text*);
-    virtual void handle(Command*);
-    virtual void handle(Paragraph*);
+    void handle(unsigned paragraph);
+    bool handleCommand(unsigned command);
 
     Document *document;
 };
 
-struct Node {
-    virtual ~Node();
-    virtual void handle(DocumentProcessor*) = 0;
-
-    void add(Node *n);
-    void add(Fragment *n);
-    bool isEmpty() const;
-    int size() const;
-    Node* at(unsigned idx);
-
-    std::vector<Node*> children;
-};
-
 struct LinkTarget {
     std::string name;
     std::string targetPage;
     std::string displayText;
     bool isFragment;
+    // the article targetPage belongs to, set by Document::resolveLinks()
+    Article *article;
 };
 
-
-struct Text : public Node {
-    Text(const std::string &s);
-    virtual void handle(DocumentProcessor *processor) override;
-
-    std::string text;
+// A \pageref made by an article, with the anchor it appears under: the last
+// label before it, or nothing at the top of the page.
+struct Reference {
+    std::string target, anchor;
 };
 
-
-struct Fragment : public Node {
-    virtual void handle(DocumentProcessor *processor) override;
+// An article referring to another, and where in it the first such reference
+// is.
+struct Backlink {
+    Article *from;
+    const Reference *reference;
 };
 
-struct Command : public Node {
-    virtual void handle(DocumentProcessor *processor) override;
 
-    std::string command;
-};
+// Where an article sits in the list of its world or category.
+struct NavPosition {
+    NavPosition();
 
-struct Paragraph : public Node {
-    virtual void handle(DocumentProcessor *processor) override;
+    bool listed;
+    unsigned index;
+    Article *prev, *next;
 };
 
-
 struct Article {
     Article();
     ~Article();
-    void add(Paragraph *n);
-    void process(DocumentProcessor &processor);
+    template<class Processor>
+    void process(Processor &processor);
 
     std::string sourceFile;
     std::string name, filename, world, category;
-    std::vector<Paragraph*> paragraphs;
+    // the source file the tree's text lies in, and the AST cache entry its
+    // nodes were mapped from, if they were
+    SourceFile *source;
+    SourceFile *cachedTree;
+    SyntaxTree tree;
+    std::size_t sourceSize;
+    unsigned long long sourceHash;
     bool hasPageInfo;
+    // false when the article was restored from the build manifest and its
+    // text has not been parsed this run
+    bool isLoaded;
+
+    // labels defined (in source order) and \pageref targets used by the
+    // article, recorded while scanning
+    std::vector<LinkTarget> labels;
+    std::vector<Reference> references;
+    // the names of the images the article shows, recorded while scanning
+    std::vector<std::string> images;
+    // the other articles referring to this one, in document order; set by
+    // Document::resolveLinks()
+    std::vector<Backlink> referencedBy;
+
+    // set after each scan by buildNavigation()
+    NavPosition worldPos, categoryPos;
+    std::string worldNav, catNav;
+};
+
+// Run a pass over each paragraph of the article in turn.
+template<class Processor>
+void Article::process(Processor &processor) {
+    for (unsigned paragraph = 0; paragraph < tree.count; paragraph = tree.nodes[paragraph].next) {
+        processor.handle(paragraph);
+    }
+}
+
+struct SearchTerm {
+    std::string term;
+    unsigned anchor, weight;
+};
+
+// The words of an article for the search index, collected while it is
+// rendered. Each word's weight is summed per anchor, the last label before
+// it; anchor 0 is the top of the page.
+struct SearchTerms {
+    SearchTerms();
+    void clear();
+    void addAnchor(const std::string &name);
+    void add(StringView text, unsigned weight);
+    void addTitle(const std::string &title);
+    void finish();
+    bool operator==(const SearchTerms &other) const;
+
+    std::vector<std::string> anchors;
+    unsigned anchor;
+    std::vector<SearchTerm> terms;
+};
+
+// The files of the search index a build writes again. Unless all is set, the
+// shards and documents files not listed are left as the last build wrote
+// them, which needs the articles to be numbered as they were then.
+struct SearchIndexChanges {
+    SearchIndexChanges();
+    void addChangedTerms(const SearchTerms &before, const SearchTerms &after);
+    void addDocument(unsigned doc);
+
+    bool all;
+    std::set<unsigned> shards, documentFiles;
+};
+
+// An image shown by the articles. It is copied into out/ under a name that
+// includes the hash of its content, so the copy never changes and can be
+// cached indefinitely.
+struct ImageAsset {
+    ImageAsset();
+
+    // the PNG file read, and where its copy goes under out/
+    std::string source, output;
+    bool found;
+    unsigned long long hash;
+    unsigned width, height;
+    // the size and modification time the file had when it was hashed, so an
+    // unchanged file need not be read again
+    std::size_t size;
+    long long modified;
+    // why the image cannot be used, if it cannot
+    std::string problem;
 };
 
 struct Document {
+    void addArticle(Article *article);
     void addLink(const LinkTarget &target, ErrorLog &errorLog);
-    Article* byFile(const std::string &filename);
+    void resolveLinks();
+    Article* byFile(const std::string &filename) const;
 
     std::vector<Article*> articles;
+    std::unordered_map<std::string, Article*> files;
     std::map<std::string, LinkTarget> links;
     std::string graphicsPath;
     std::map<std::string, std::vector<Article*>> categories;
     std::map<std::string, std::vector<Article*>> worlds;
+    // every image shown by an article, by name; filled by prepareImages()
+    std::map<std::string, ImageAsset> images;
+};
+
+struct ManifestEntry {
+    std::string sourceFile, filename, name, world, category;
+    unsigned long long sourceHash, headerHash, referenceHash;
+    std::size_t sourceSize;
+    bool hasPageInfo;
+    std::vector<LinkTarget> labels;
+    std::vector<Reference> references;
+    std::vector<std::string> images;
+    std::vector<std::string> warnings;
+};
+
+struct BuildManifest {
+    BuildManifest();
+    bool load(const std::string &filename);
+    bool save(const std::string &filename) const;
+    const ManifestEntry* find(const std::string &sourceFile) const;
+
+    unsigned long long templateHash, indexHash;
+    std::map<std::string, ManifestEntry> entries;
+    std::map<std::string, ImageAsset> images;
+    // pages with compressed copies, and the hash of the content compressed
+    std::map<std::string, unsigned long long> compressed;
+};
+
+enum class TemplateSlot {
+    None, Title, CatNav, WorldNav, GenTime
+};
+
+// The values substituted into a page template.
+struct PageFields {
+    std::string title, catNav, worldNav, genTime;
+};
+
+// A page template split once into literal text and slots, so each page can be
+// written straight to its output without copying the template.
+struct PageTemplate {
+    struct Segment {
+        TemplateSlot slot;
+        std::string::size_type start, length;
+    };
+
+    void parse(const std::string &templateText);
+    void write(std::ostream &out, const PageFields &fields) const;
+
+    std::string text;
+    std::vector<Segment> segments;
 };
 
+struct Uring;
+
+struct OutputPage {
+    std::string filename;
+    std::string content;
+};
+
+// Somewhere finished pages are handed to.
+struct PageOutput {
+    virtual ~PageOutput() { }
+    virtual void submit(const std::string &filename, std::string &&content) = 0;
+};
+
+// Writes rendered pages to disk in the background, batching the opens,
+// writes and closes through io_uring when the kernel allows it and otherwise
+// using a pool of threads making ordinary system calls.
+struct PageWriter : public PageOutput {
+    PageWriter(unsigned threads, bool allowUring);
+    ~PageWriter();
+    virtual void submit(const std::string &filename, std::string &&content) override;
+    const std::vector<std::string>& finish();
+
+    bool takePages(std::vector<OutputPage> &pages, unsigned max);
+    void addFailure(const std::string &filename);
+    void syncLoop();
+    void uringLoop();
+
+    std::mutex lock;
+    std::condition_variable ready, drained;
+    std::deque<OutputPage> queue;
+    // the most pages left waiting to be written before submit() blocks, or 0
+    // for no limit
+    std::size_t maxQueued;
+    std::vector<std::thread> workers;
+    std::vector<std::string> failed;
+    bool finishing;
+    bool usingUring;
+    Uring *uring;
+};
+
+// Hands pages on to another output along with gzip copies of them, and
+// zstd copies when built with libzstd, for servers that send pre-compressed
+// files. Pages are compressed on the thread submitting them.
+struct CompressingOutput : public PageOutput {
+    CompressingOutput(PageOutput &output, const std::map<std::string, unsigned long long> &previous, std::map<std::string, unsigned long long> &current);
+    virtual void submit(const std::string &filename, std::string &&content) override;
+
+    PageOutput &output;
+    // the hash of each page's content when its copies were last made, as of
+    // the last build and of this one
+    const std::map<std::string, unsigned long long> &previous;
+    std::map<std::string, unsigned long long> &current;
+    std::mutex lock;
+};
+
+// Runs builds of a project. A builder can run more than one build, reusing
+// whatever it can from the last one; in watch mode it also keeps every
+// article's tree in memory between builds.
+struct Builder {
+    Builder(const std::string &filelist);
+    ~Builder();
+    bool loadProject();
+    void loadTemplates();
+    int build();
+    int runPhases();
+    bool scan(ErrorLog &errorLog);
+    bool rescan(ErrorLog &errorLog);
+    void saveManifest();
+    bool renderArticle(Article *article, const PageFields &fields, std::ostream &page, ErrorLog &errorLog, SearchTerms *searchTerms = nullptr);
+
+    std::string filelist;
+    std::vector<std::string> sources;
+    std::string front, back;
+    PageTemplate frontTemplate, backTemplate;
+    Document document;
+    BuildManifest previous;
+    bool havePrevious;
+    bool keepResident;
+    // free each article's tree and source as soon as it has been scanned or
+    // rendered, parsing it again (or mapping its cached tree) when needed
+    bool lowMemory;
+    // collect the words of each page and write the search index
+    bool searchIndex;
+    std::string traceFile;
+    bool showStats;
+    std::map<std::string, Article*> resident;
+    // when changesKnown is set, only the sources in changedSources are
+    // checked for changes
+    bool changesKnown;
+    std::set<std::string> changedSources;
+    // in watch mode, set while the document, the resident articles and the
+    // manifest in memory all describe the last build, which succeeded, so
+    // the next one can patch them with rescan()
+    bool documentCurrent;
+    // in watch mode, set while the manifest in memory has not been saved
+    bool manifestPending;
+    // the articles the last scan looked at, by index, with their new
+    // manifest entries and whether they were parsed; rescan() only looks at
+    // the articles that changed or that the changes may affect
+    std::vector<unsigned> examined;
+    std::vector<ManifestEntry> entries;
+    std::vector<char> parsedNow;
+    // set by rescan(): by article, whether its title and nav bars, or its
+    // references, backlinks and images, may differ from the last build, and
+    // whether any label or anything else the index pages show changed
+    std::vector<char> staleHeaders, staleReferences;
+    bool linksChanged, indexInputsChanged;
+    // in watch mode, the words each article had in the last search index, by
+    // source file, and the pages the index listed, in order
+    std::map<std::string, SearchTerms> residentTerms;
+    std::vector<std::string> searchPages;
+    unsigned parseCount;
+    std::string genTime;
+};
+
+int watchProject(Builder &builder);
+int serveProject(Builder &builder, unsigned short port);
+
+extern bool tracing;
+long long traceNow();
+
+// Records how long the enclosing scope takes as one span of the trace.
+// Nothing is recorded, and almost nothing done, when tracing is off. The
+// detail string must outlive the span.
+struct TraceSpan {
+    TraceSpan(const char *category, const char *name)
+    : category(category), name(name), detail(nullptr), start(tracing ? traceNow() : -1)
+    { }
+    TraceSpan(const char *category, const char *name, const std::string &detail)
+    : category(category), name(name), detail(&detail), start(tracing ? traceNow() : -1)
+    { }
+    ~TraceSpan() {
+        finish();
+    }
+    // end the span before the scope does
+    void finish() {
+        if (start >= 0) record();
+        start = -1;
+    }
+    void record();
+
+    const char *category, *name;
+    const std::string *detail;
+    long long start;
+};
+
+// Adds the time spent rendering a command to the totals for its type.
+struct CommandTimer {
+    CommandTimer(CommandId id)
+    : id(id), start(tracing ? traceNow() : -1), parent(nullptr), childTime(0)
+    {
+        if (start >= 0) enter();
+    }
+    ~CommandTimer() {
+        if (start >= 0) leave();
+    }
+    void enter();
+    void leave();
+
+    CommandId id;
+    long long start;
+    CommandTimer *parent;
+    long long childTime;
+};
+
+void finishTrace(const std::string &filename, bool showStats, unsigned statsCount);
+
 struct CommandInfo {
-    std::string name;
+    const char *name;
     int minArgs, maxArgs;
+    const char *format;
 };
 
 enum class ErrorType {
@@ -145,6 +629,7 @@ struct ErrorMsg {
 struct ErrorLog {
     ErrorLog();
     void add(ErrorType type, const std::string &file, const std::string &msg);
+    void append(const ErrorLog &other);
     bool hasErrors() const;
     bool isEmpty() const;
 
@@ -152,16 +637,74 @@ struct ErrorLog {
     std::vector<ErrorMsg> errors;
 };
 
+extern const CommandInfo commandInfo[];
+CommandId lookupCommand(StringView name);
+const CommandInfo& getCommandInfo(CommandId id);
+
 std::string& trim(std::string &text);
-Article* processFile(const std::string &sourceFile, ErrorLog &errorLog);
+bool is_space(char c);
+std::string collapseLines(StringView text);
+Article* processFile(const std::string &sourceFile, ErrorLog &errorLog, unsigned long long sourceHash = 0, SourceFile *source = nullptr);
+bool loadArticle(Article *article, ErrorLog &errorLog, SourceFile *source = nullptr);
+void unloadArticle(Article *article);
+bool loadCachedArticle(Article *article, SourceFile *source, bool sourceHashed, ErrorLog &errorLog);
+void saveCachedArticle(const Article *article, const ErrorLog &errorLog, std::size_t firstMessage, bool sourceHashed);
+void pruneAstCache(const Document &document);
+Article* restoreArticle(const ManifestEntry &entry, ErrorLog &errorLog);
+void replayWarnings(const ManifestEntry &entry, ErrorLog &errorLog);
+void replayScan(Document &document, Article *article, ErrorLog &errorLog);
+ManifestEntry makeManifestEntry(const Article *article, const ErrorLog &articleLog);
+unsigned long long hashReferences(const Document &document, const Article *article);
+unsigned long long hashIndexInputs(Document &document);
 int g_toupper(int c);
 bool is_identifier(char c);
 std::string& replaceText(std::string &text, const std::string &from, const std::string &to);
 std::string readFile(const std::string &filename);
-
-void make_indexes(const std::string &pageTop, const std::string &pageBottom, Document &document);
+bool fileExists(const std::string &filename);
+std::string escapeJson(const std::string &text);
+
+// Bump whenever the parser builds a different tree from the same source, so
+// cached trees from older builds are not used.
+const unsigned parserVersion = 1;
+
+const unsigned long long HASH_SEED = 14695981039346656037ULL;
+unsigned long long hashBytes(const char *data, std::size_t size, unsigned long long hash = HASH_SEED);
+unsigned long long hashText(const std::string &text, unsigned long long hash = HASH_SEED);
+
+void runOrdered(unsigned count, unsigned jobs,
+                const std::function<void(unsigned)> &work,
+                const std::function<void(unsigned)> &consume);
+void runParallel(unsigned count, unsigned jobs, const std::function<void(unsigned)> &work);
+
+void writeHtmlText(std::ostream &out, StringView text, TextMode mode);
+void dumpErrors(const ErrorLog &errorLog, bool hideWarnings);
+void buildNavigation(Document &document);
+void makePageFields(const Article *article, PageFields &fields);
+void writeBacklinks(std::ostream &out, const Article *article);
+void prepareImages(Document &document, const BuildManifest *previous, bool copy, ErrorLog &errorLog);
+const ImageAsset* findImageAsset(const Document &document, const std::string &output);
+void reportOrphans(const Document &document);
+unsigned headingWeight(CommandId id);
+bool haveSearchTerms(const Article *article);
+void saveSearchTerms(const Article *article, const SearchTerms &terms, PageOutput *output = nullptr);
+bool loadSearchTerms(const Article *article, SearchTerms &terms);
+void removeSearchTerms(const std::string &filename);
+std::string uncompressedName(const std::string &filename);
+void removeCompressedCopies(const std::string &filename);
+void writeSearchIndex(const Document &document, const std::vector<const SearchTerms*> &terms, const SearchIndexChanges &changes, PageOutput &output);
+void streamSearchIndex(const Document &document, const std::function<bool(unsigned, SearchTerms&)> &collect, PageOutput &output);
+void make_indexes(const PageTemplate &pageTop, const PageTemplate &pageBottom, const std::string &genTime, Document &document, PageOutput &output);
 
 extern bool showMissingWorld;
 extern bool showMissingCategory;
+extern bool showOrphans;
+extern bool compressOutput;
+extern unsigned jobCount;
+extern bool useUring;
+extern bool hideWarnings;
+extern bool fullRebuild;
+extern bool useAstCache;
+extern unsigned maxNesting;
+extern std::size_t maxSourceSize;
 
 #endif
@@ -1,28 +1,51 @@
 #include <algorithm>
-#include <ctime>
-#include <fstream>
+#include <cctype>
+#include <cstring>
 #include <iostream>
 #include <map>
+#include <sstream>
 #include "latexwiki.h"
 
+// Where an entry sorts, worked out once from its name: case and accents are
+// folded, punctuation only separates words and a leading "The", "A" or "An"
+// is skipped.
+struct CollationKey {
+    CollationKey();
+
+    std::string key;
+    // the first eight bytes of key as one number, which settles most
+    // comparisons
+    unsigned long long prefix;
+    // the heading the entry is listed under in the alphabetical index
+    std::string letter;
+};
+
+// An entry of the index pages. It refers to its link and article rather than
+// copying their text, so bucketing and sorting entries only moves pointers.
 struct IndexEntry {
-    std::string name;
-    std::string category;
-    std::string world;
-    std::string targetFile;
-    std::string targetFragment;
+    IndexEntry(const LinkTarget *link, const Article *page);
+
+    const LinkTarget *link;
+    const Article *page;
+    // set once every entry has been gathered
+    CollationKey collation;
+
+    const std::string& name() const { return link->displayText; }
 };
 
-void make_alpha(const std::string &pageTop, const std::string &pageBottom, std::vector<IndexEntry> &pinfo);
-void make_world(const std::string &pageTop, const std::string &pageBottom, std::vector<IndexEntry> &pinfo);
-void make_category(const std::string &pageTop, const std::string &pageBottom, std::vector<IndexEntry> &pinfo);
+CollationKey::CollationKey()
+: prefix(0)
+{ }
 
-bool sort_alpha(const IndexEntry &left, const IndexEntry &right) {
-    return left.name < right.name;
-}
+IndexEntry::IndexEntry(const LinkTarget *link, const Article *page)
+: link(link), page(page)
+{ }
 
-std::vector<std::string> missingWorld;
-std::vector<std::string> missingCategory;
+// Entries of one page or heading, as positions in the list of all entries.
+typedef std::vector<unsigned> IndexBucket;
+
+void make_alpha(const PageTemplate &pageTop, const PageTemplate &pageBottom, const PageFields &fields, const std::vector<IndexEntry> &pinfo, const IndexBucket &order, PageOutput &output);
+void make_grouped(const PageTemplate &pageTop, const PageTemplate &pageBottom, const PageFields &fields, const char *title, const char *filename, const std::vector<IndexEntry> &pinfo, const std::map<std::string, IndexBucket> &groups, PageOutput &output);
 
 void printList(const std::vector<std::string> &list) {
     for (unsigned i = 0; i < list.size(); ++i) {
@@ -36,166 +59,252 @@ void printList(const std::vector<std::string> &list) {
     }
 }
 
-void make_indexes(const std::string &pageTop, const std::string &pageBottom, Document &document) {
-    std::vector<IndexEntry> pinfo;
-
-    time_t rawtime;
-    struct tm *timeinfo;
-    char buffer[80];
-    time (&rawtime);
-    timeinfo = localtime(&rawtime);
-    strftime(buffer, sizeof(buffer), "%b %d, %Y", timeinfo);
-    std::string newBack = pageBottom;
-    replaceText(newBack, "%GENTIME%", buffer);
-
-    for (auto iter : document.links) {
-        Article *toPage = document.byFile(iter.second.targetPage);
-        if (!toPage) {
-            continue;
-        }
+// The code point starting at pos, moving pos past it. A byte that does not
+// start a valid sequence is returned as invalidCodePoint.
+static const unsigned invalidCodePoint = ~0u;
 
-        IndexEntry entry;
-        entry.name = iter.second.displayText;
-        entry.targetFile = toPage->filename;
-        if (iter.second.isFragment) {
-            entry.targetFragment = iter.second.name;
-        } else {
-            entry.world = toPage->world;
-            entry.category = toPage->category;
-        }
-        pinfo.push_back(entry);
+static unsigned decodeUtf8(const std::string &text, std::string::size_type &pos) {
+    const unsigned char first = text[pos++];
+    if (first < 0x80) return first;
+    unsigned length, c;
+    if (first >= 0xC2 && first <= 0xDF)         { length = 1; c = first & 0x1F; }
+    else if (first >= 0xE0 && first <= 0xEF)    { length = 2; c = first & 0x0F; }
+    else if (first >= 0xF0 && first <= 0xF4)    { length = 3; c = first & 0x07; }
+    else return invalidCodePoint;
+    if (text.size() - pos < length) return invalidCodePoint;
+    for (unsigned i = 0; i < length; ++i) {
+        const unsigned char next = text[pos + i];
+        if ((next & 0xC0) != 0x80) return invalidCodePoint;
+        c = (c << 6) | (next & 0x3F);
     }
+    pos += length;
+    return c;
+}
 
-    std::sort(pinfo.begin(), pinfo.end(), sort_alpha);
-    make_alpha(pageTop, newBack, pinfo);
-    make_world(pageTop, newBack, pinfo);
-    make_category(pageTop, newBack, pinfo);
-
-    if (showMissingWorld && !missingWorld.empty()) {
-        std::cerr << "Articles without defined world:\n";
-        for (const std::string &name : missingWorld) {
-            std::cerr << "    " << name << '\n';
-        }
-    }
-    if (showMissingCategory && !missingCategory.empty()) {
-        std::cerr << "Articles without defined category:\n";
-        for (const std::string &name : missingCategory) {
-            std::cerr << "    " << name << '\n';
-        }
+static void encodeUtf8(std::string &out, unsigned c) {
+    if (c < 0x80) {
+        out += static_cast<char>(c);
+    } else if (c < 0x800) {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out += static_cast<char>(0xE0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
     }
 }
 
-void make_alpha(const std::string &pageTop, const std::string &pageBottom, std::vector<IndexEntry> &pinfo) {
-    std::ofstream alphaFile("out/by_alpha.html");
-    std::string newFront = pageTop;
-    std::string::size_type titlePos = newFront.find("%TITLE%");
-    newFront.replace(titlePos, 7, "Alphabetical Index");
-    replaceText(newFront, "%CATNAV%", "");
-    replaceText(newFront, "%WORLDNAV%", "");
-    alphaFile << newFront;
-    alphaFile << "<h2>Alphabetical Index</h2>\n";
-    alphaFile << "<ul class='indexlist'>\n";
+// The unaccented lower case letters of U+00C0 to U+00FF; the two empty
+// entries are the multiplication and division signs.
+static const char *latin1Folds[64] = {
+    "a", "a", "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i",
+    "d", "n", "o", "o", "o", "o", "o", "", "o", "u", "u", "u", "u", "y", "th", "ss",
+    "a", "a", "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i",
+    "d", "n", "o", "o", "o", "o", "o", "", "o", "u", "u", "u", "u", "y", "th", "y"
+};
 
-    char lastchar = 0;
-    for (const IndexEntry entry : pinfo) {
-        char firstchar = g_toupper(entry.name[0]);
-        if (lastchar != firstchar) {
-            alphaFile << "</ul>\n<h3 class='indexhead'>" << firstchar << "</h3>\n<ul class='indexlist'>\n";
-            lastchar = firstchar;
-        }
+// The base letters of U+0100 to U+017F, Latin Extended-A. The ligatures IJ
+// and OE are marked with '*'.
+static const char latinExtendedFolds[] =
+    "aaaaaaccccccccddddeeeeeeeeeegggggggghhhhiiiiiiiiii**jjkkkllllllllll"
+    "nnnnnnnnnoooooo**rrrrrrssssssssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+static_assert(sizeof(latinExtendedFolds) == 0x80 + 1, "one letter for each code point");
 
-        alphaFile << "<li><a href='" << entry.targetFile;
-        if (!entry.targetFragment.empty()) {
-            alphaFile << '#' << entry.targetFragment;
-        }
-        alphaFile << "'>" << entry.name;
-        alphaFile << "</a>\n";
+// Append code point c to a collation key, folded to lower case and without
+// accents. Anything other than a letter or digit becomes a word break.
+static void foldCodePoint(std::string &key, unsigned c) {
+    if (c < 0x80 && std::isalnum(c)) {
+        key += static_cast<char>(std::tolower(c));
+    } else if (c == '\'' || c == 0x2019) {
+        // apostrophes join the parts of a word
+    } else if (c >= 0xC0 && c <= 0xFF && latin1Folds[c - 0xC0][0]) {
+        key += latin1Folds[c - 0xC0];
+    } else if (c >= 0x100 && c <= 0x17F) {
+        const char base = latinExtendedFolds[c - 0x100];
+        if (base != '*') key += base;
+        else key += c < 0x140 ? "ij" : "oe";
+    } else if (c < 0x100 || (c >= 0x2000 && c <= 0x206F) || c == invalidCodePoint) {
+        // ASCII and Latin-1 punctuation, spaces and general punctuation
+        if (!key.empty() && key.back() != ' ') key += ' ';
+    } else {
+        if (c >= 0x391 && c <= 0x3A9) c += 0x20;        // Greek
+        else if (c >= 0x410 && c <= 0x42F) c += 0x20;   // Cyrillic
+        else if (c >= 0x400 && c <= 0x40F) c += 0x50;
+        encodeUtf8(key, c);
     }
+}
 
-    alphaFile << "</ul>\n";
-    alphaFile << pageBottom;
-    alphaFile.close();
+// The heading for a key: the upper case form of its first letter.
+static std::string headingLetter(const std::string &key) {
+    if (key.empty()) return "#";
+    std::string::size_type pos = 0;
+    unsigned c = decodeUtf8(key, pos);
+    if (c < 0x80) c = std::toupper(c);
+    else if (c == 0x3C2) c = 0x3A3;                     // final sigma
+    else if (c >= 0x3B1 && c <= 0x3C9) c -= 0x20;
+    else if (c >= 0x430 && c <= 0x44F) c -= 0x20;
+    else if (c >= 0x450 && c <= 0x45F) c -= 0x50;
+    std::string letter;
+    encodeUtf8(letter, c);
+    return letter;
 }
 
-void make_world(const std::string &pageTop, const std::string &pageBottom, std::vector<IndexEntry> &pinfo) {
-    std::map<std::string, std::vector<IndexEntry>> data;
+static CollationKey collationKey(const std::string &name) {
+    CollationKey result;
+    std::string &key = result.key;
+    key.reserve(name.size());
+    for (std::string::size_type pos = 0; pos < name.size(); ) {
+        foldCodePoint(key, decodeUtf8(name, pos));
+    }
+    if (!key.empty() && key.back() == ' ') key.pop_back();
+    if (!key.empty() && key[0] == ' ') key.erase(0, 1);
 
-    for (const IndexEntry entry : pinfo) {
-        if (entry.world.empty()) {
-            if (entry.targetFragment.empty()) {
-                missingWorld.push_back(entry.name);
-            }
-            continue;
+    for (const char *article : { "the ", "a ", "an " }) {
+        const std::string::size_type length = std::strlen(article);
+        if (key.size() > length && key.compare(0, length, article) == 0) {
+            key.erase(0, length);
+            break;
         }
+    }
 
-        data[entry.world].push_back(entry);
+    result.prefix = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+        result.prefix = (result.prefix << 8) | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0);
     }
+    result.letter = headingLetter(key);
+    return result;
+}
 
-    std::ofstream alphaFile("out/by_world.html");
-    std::string newFront = pageTop;
-    std::string::size_type titlePos = newFront.find("%TITLE%");
-    newFront.replace(titlePos, 7, "World Index");
-    replaceText(newFront, "%CATNAV%", "");
-    replaceText(newFront, "%WORLDNAV%", "");
-    alphaFile << newFront;
-    alphaFile << "<h2>World Index</h2>\n";
-    alphaFile << "<ul>\n";
+static bool collatesBefore(const IndexEntry &left, const IndexEntry &right) {
+    if (left.collation.prefix != right.collation.prefix) return left.collation.prefix < right.collation.prefix;
+    const int order = left.collation.key.compare(right.collation.key);
+    if (order != 0) return order < 0;
+    return left.name() < right.name();
+}
 
-    for (auto iter : data) {
-        alphaFile << "</ul>\n<h3 class='indexhead'>" << iter.first << "</h3>\n<ul class='indexlist'>\n";
-        for (const IndexEntry &entry : iter.second) {
-            alphaFile << "<li><a href='" << entry.targetFile;
-            if (!entry.targetFragment.empty()) {
-                alphaFile << '#' << entry.targetFragment;
-            }
-            alphaFile << "'>" << entry.name;
-            alphaFile << "</a>\n";
-        }
-        alphaFile << "</ul>\n";
+static void writeEntry(std::ostream &out, const IndexEntry &entry) {
+    out << "<li><a href='" << entry.page->filename;
+    if (entry.link->isFragment) {
+        out << '#' << entry.link->name;
     }
+    out << "'>" << entry.name();
+    out << "</a>\n";
+}
 
-    alphaFile << pageBottom;
-    alphaFile.close();
+static void showMissing(const char *heading, const std::vector<IndexEntry> &pinfo, const IndexBucket &missing) {
+    if (missing.empty()) return;
+    std::cerr << heading << '\n';
+    for (unsigned i : missing) {
+        std::cerr << "    " << pinfo[i].name() << '\n';
+    }
 }
 
+// Build the alphabetical, world and category indexes. One pass over the links
+// buckets every entry into each page and heading it belongs under; the
+// buckets are then sorted in parallel and the three pages written
+// concurrently.
+void make_indexes(const PageTemplate &pageTop, const PageTemplate &pageBottom, const std::string &genTime, Document &document, PageOutput &output) {
+    std::vector<IndexEntry> pinfo;
+    pinfo.reserve(document.links.size());
+    IndexBucket alpha, missingWorld, missingCategory;
+    std::map<std::string, IndexBucket> worlds, categories;
+    PageFields fields;
+    fields.genTime = genTime;
+
+    for (const auto &iter : document.links) {
+        const LinkTarget &link = iter.second;
+        if (!link.article) continue;
 
-void make_category(const std::string &pageTop, const std::string &pageBottom, std::vector<IndexEntry> &pinfo) {
-    std::map<std::string, std::vector<IndexEntry>> data;
+        const unsigned index = pinfo.size();
+        pinfo.push_back(IndexEntry(&link, link.article));
+        alpha.push_back(index);
+        // only whole articles are listed by world and category
+        if (link.isFragment) continue;
+        if (link.article->world.empty()) missingWorld.push_back(index);
+        else worlds[link.article->world].push_back(index);
+        if (link.article->category.empty()) missingCategory.push_back(index);
+        else categories[link.article->category].push_back(index);
+    }
 
-    for (const IndexEntry entry : pinfo) {
-        if (entry.category.empty()) {
-            if (entry.targetFragment.empty()) {
-                missingCategory.push_back(entry.name);
-            }
-            continue;
+    runParallel(pinfo.size(), jobCount, [&](unsigned i) {
+        pinfo[i].collation = collationKey(pinfo[i].name());
+    });
+
+    std::vector<IndexBucket*> buckets = { &alpha, &missingWorld, &missingCategory };
+    for (auto &iter : worlds) buckets.push_back(&iter.second);
+    for (auto &iter : categories) buckets.push_back(&iter.second);
+    runParallel(buckets.size(), jobCount, [&](unsigned n) {
+        // entries with the same name keep the order of their labels
+        std::stable_sort(buckets[n]->begin(), buckets[n]->end(), [&](unsigned left, unsigned right) {
+            return collatesBefore(pinfo[left], pinfo[right]);
+        });
+    });
+
+    runParallel(3, jobCount, [&](unsigned n) {
+        switch (n) {
+        case 0:
+            make_alpha(pageTop, pageBottom, fields, pinfo, alpha, output);
+            break;
+        case 1:
+            make_grouped(pageTop, pageBottom, fields, "World Index", "by_world.html", pinfo, worlds, output);
+            break;
+        case 2:
+            make_grouped(pageTop, pageBottom, fields, "Category Index", "by_category.html", pinfo, categories, output);
+            break;
         }
+    });
+
+    if (showMissingWorld) showMissing("Articles without defined world:", pinfo, missingWorld);
+    if (showMissingCategory) showMissing("Articles without defined category:", pinfo, missingCategory);
+}
 
-        data[entry.category].push_back(entry);
+void make_alpha(const PageTemplate &pageTop, const PageTemplate &pageBottom, const PageFields &fields, const std::vector<IndexEntry> &pinfo, const IndexBucket &order, PageOutput &output) {
+    TraceSpan span("index", "by_alpha.html");
+    std::ostringstream alphaFile;
+    PageFields pageFields = fields;
+    pageFields.title = "Alphabetical Index";
+    pageTop.write(alphaFile, pageFields);
+    alphaFile << "<h2>Alphabetical Index</h2>\n";
+    alphaFile << "<ul class='indexlist'>\n";
+
+    const std::string *lastLetter = nullptr;
+    for (unsigned i : order) {
+        const IndexEntry &entry = pinfo[i];
+        if (!lastLetter || *lastLetter != entry.collation.letter) {
+            alphaFile << "</ul>\n<h3 class='indexhead'>" << entry.collation.letter << "</h3>\n<ul class='indexlist'>\n";
+            lastLetter = &entry.collation.letter;
+        }
+        writeEntry(alphaFile, entry);
     }
 
-    std::ofstream alphaFile("out/by_category.html");
-    std::string newFront = pageTop;
-    std::string::size_type titlePos = newFront.find("%TITLE%");
-    newFront.replace(titlePos, 7, "Category Index");
-    replaceText(newFront, "%CATNAV%", "");
-    replaceText(newFront, "%WORLDNAV%", "");
-    alphaFile << newFront;
-    alphaFile << "<h2>Category Index</h2>\n";
+    alphaFile << "</ul>\n";
+    pageBottom.write(alphaFile, pageFields);
+    output.submit("out/by_alpha.html", alphaFile.str());
+}
+
+// An index page with a heading for each group, such as the world index.
+void make_grouped(const PageTemplate &pageTop, const PageTemplate &pageBottom, const PageFields &fields, const char *title, const char *filename, const std::vector<IndexEntry> &pinfo, const std::map<std::string, IndexBucket> &groups, PageOutput &output) {
+    TraceSpan span("index", filename);
+    std::ostringstream alphaFile;
+    PageFields pageFields = fields;
+    pageFields.title = title;
+    pageTop.write(alphaFile, pageFields);
+    alphaFile << "<h2>" << title << "</h2>\n";
     alphaFile << "<ul>\n";
 
-    for (auto iter : data) {
+    for (const auto &iter : groups) {
         alphaFile << "</ul>\n<h3 class='indexhead'>" << iter.first << "</h3>\n<ul class='indexlist'>\n";
-        for (const IndexEntry &entry : iter.second) {
-            alphaFile << "<li><a href='" << entry.targetFile;
-            if (!entry.targetFragment.empty()) {
-                alphaFile << '#' << entry.targetFragment;
-            }
-            alphaFile << "'>" << entry.name;
-            alphaFile << "</a>\n";
+        for (unsigned i : iter.second) {
+            writeEntry(alphaFile, pinfo[i]);
         }
         alphaFile << "</ul>\n";
     }
 
-    alphaFile << pageBottom;
-    alphaFile.close();
+    pageBottom.write(alphaFile, pageFields);
+    output.submit(std::string("out/") + filename, alphaFile.str());
 }
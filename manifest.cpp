@@ -0,0 +1,284 @@
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "latexwiki.h"
+
+static const char *manifestHeader = "latexwiki-manifest 3";
+
+static std::string escapeField(const std::string &text) {
+    std::string result;
+    for (char c : text) {
+        switch (c) {
+            case '\\':  result += "\\\\"; break;
+            case '\t':  result += "\\t"; break;
+            case '\n':  result += "\\n"; break;
+            default:    result += c;
+        }
+    }
+    return result;
+}
+
+static std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields(1);
+    for (std::string::size_type i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if (c == '\t') {
+            fields.push_back("");
+        } else if (c == '\\' && i + 1 < line.size()) {
+            ++i;
+            switch (line[i]) {
+                case 't':   fields.back() += '\t'; break;
+                case 'n':   fields.back() += '\n'; break;
+                default:    fields.back() += line[i];
+            }
+        } else {
+            fields.back() += c;
+        }
+    }
+    return fields;
+}
+
+static unsigned long long toHash(const std::string &text) {
+    return std::strtoull(text.c_str(), nullptr, 16);
+}
+
+static std::string fromHash(unsigned long long hash) {
+    std::stringstream text;
+    text << std::hex << hash;
+    return text.str();
+}
+
+
+BuildManifest::BuildManifest()
+: templateHash(0), indexHash(0)
+{ }
+
+bool BuildManifest::load(const std::string &filename) {
+    TraceSpan span("io", "load manifest", filename);
+    std::ifstream inf(filename);
+    if (!inf) return false;
+    std::string line;
+    if (!std::getline(inf, line) || line != manifestHeader) return false;
+
+    ManifestEntry *entry = nullptr;
+    while (std::getline(inf, line)) {
+        std::vector<std::string> fields = splitFields(line);
+        const std::string &key = fields[0];
+        if (key == "templates" && fields.size() == 2) {
+            templateHash = toHash(fields[1]);
+        } else if (key == "indexes" && fields.size() == 2) {
+            indexHash = toHash(fields[1]);
+        } else if (key == "article" && fields.size() == 10) {
+            ManifestEntry &newEntry = entries[fields[1]];
+            newEntry.sourceFile = fields[1];
+            newEntry.filename = fields[2];
+            newEntry.name = fields[3];
+            newEntry.world = fields[4];
+            newEntry.category = fields[5];
+            newEntry.hasPageInfo = fields[6] == "1";
+            newEntry.sourceSize = std::strtoull(fields[7].c_str(), nullptr, 10);
+            newEntry.sourceHash = toHash(fields[8]);
+            newEntry.headerHash = toHash(fields[9]);
+            newEntry.referenceHash = 0;
+            entry = &newEntry;
+        } else if (key == "asset" && fields.size() == 9) {
+            ImageAsset &image = images[fields[1]];
+            image.source = fields[2];
+            image.output = fields[3];
+            image.size = std::strtoull(fields[4].c_str(), nullptr, 10);
+            image.modified = std::strtoll(fields[5].c_str(), nullptr, 10);
+            image.hash = toHash(fields[6]);
+            image.width = std::strtoul(fields[7].c_str(), nullptr, 10);
+            image.height = std::strtoul(fields[8].c_str(), nullptr, 10);
+            image.found = true;
+        } else if (key == "compressed" && fields.size() == 3) {
+            compressed[fields[1]] = toHash(fields[2]);
+        } else if (!entry) {
+            return false;
+        } else if (key == "label" && fields.size() == 5) {
+            LinkTarget target = { fields[2], fields[3], fields[4], fields[1] == "1", nullptr };
+            entry->labels.push_back(target);
+        } else if (key == "ref" && fields.size() == 3) {
+            entry->references.push_back(Reference{fields[1], fields[2]});
+        } else if (key == "image" && fields.size() == 2) {
+            entry->images.push_back(fields[1]);
+        } else if (key == "refhash" && fields.size() == 2) {
+            entry->referenceHash = toHash(fields[1]);
+        } else if (key == "warning" && fields.size() == 2) {
+            entry->warnings.push_back(fields[1]);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BuildManifest::save(const std::string &filename) const {
+    TraceSpan span("io", "save manifest", filename);
+    std::ofstream outf(filename);
+    if (!outf) return false;
+
+    outf << manifestHeader << '\n';
+    outf << "templates\t" << fromHash(templateHash) << '\n';
+    outf << "indexes\t" << fromHash(indexHash) << '\n';
+    for (const auto &iter : compressed) {
+        outf << "compressed\t" << escapeField(iter.first) << '\t' << fromHash(iter.second) << '\n';
+    }
+    for (const auto &iter : images) {
+        const ImageAsset &image = iter.second;
+        if (!image.found) continue;
+        outf << "asset\t" << escapeField(iter.first);
+        outf << '\t' << escapeField(image.source);
+        outf << '\t' << escapeField(image.output);
+        outf << '\t' << image.size << '\t' << image.modified;
+        outf << '\t' << fromHash(image.hash);
+        outf << '\t' << image.width << '\t' << image.height << '\n';
+    }
+    for (const auto &iter : entries) {
+        const ManifestEntry &entry = iter.second;
+        outf << "article\t" << escapeField(entry.sourceFile);
+        outf << '\t' << escapeField(entry.filename);
+        outf << '\t' << escapeField(entry.name);
+        outf << '\t' << escapeField(entry.world);
+        outf << '\t' << escapeField(entry.category);
+        outf << '\t' << (entry.hasPageInfo ? 1 : 0);
+        outf << '\t' << entry.sourceSize;
+        outf << '\t' << fromHash(entry.sourceHash);
+        outf << '\t' << fromHash(entry.headerHash) << '\n';
+        for (const LinkTarget &target : entry.labels) {
+            outf << "label\t" << (target.isFragment ? 1 : 0);
+            outf << '\t' << escapeField(target.name);
+            outf << '\t' << escapeField(target.targetPage);
+            outf << '\t' << escapeField(target.displayText) << '\n';
+        }
+        for (const Reference &reference : entry.references) {
+            outf << "ref\t" << escapeField(reference.target);
+            outf << '\t' << escapeField(reference.anchor) << '\n';
+        }
+        for (const std::string &name : entry.images) {
+            outf << "image\t" << escapeField(name) << '\n';
+        }
+        outf << "refhash\t" << fromHash(entry.referenceHash) << '\n';
+        for (const std::string &message : entry.warnings) {
+            outf << "warning\t" << escapeField(message) << '\n';
+        }
+    }
+    return outf.good();
+}
+
+const ManifestEntry* BuildManifest::find(const std::string &sourceFile) const {
+    auto iter = entries.find(sourceFile);
+    if (iter == entries.end()) return nullptr;
+    return &iter->second;
+}
+
+
+// Build an article from its manifest entry without parsing its source. The
+// article's text can be loaded later with loadArticle() if it needs to be
+// rendered again.
+Article* restoreArticle(const ManifestEntry &entry, ErrorLog &errorLog) {
+    Article *article = new Article;
+    article->sourceFile = entry.sourceFile;
+    article->filename = entry.filename;
+    article->name = entry.name;
+    article->world = entry.world;
+    article->category = entry.category;
+    article->hasPageInfo = entry.hasPageInfo;
+    article->sourceSize = entry.sourceSize;
+    article->sourceHash = entry.sourceHash;
+    article->labels = entry.labels;
+    article->references = entry.references;
+    article->images = entry.images;
+    article->isLoaded = false;
+    replayWarnings(entry, errorLog);
+    return article;
+}
+
+void replayWarnings(const ManifestEntry &entry, ErrorLog &errorLog) {
+    for (const std::string &message : entry.warnings) {
+        errorLog.add(ErrorType::Warning, entry.sourceFile, message);
+    }
+}
+
+// Apply the effects ScanDocument had on the document tables when a restored
+// article was last scanned.
+void replayScan(Document &document, Article *article, ErrorLog &errorLog) {
+    for (const LinkTarget &target : article->labels) {
+        document.addLink(target, errorLog);
+    }
+    if (article->hasPageInfo) {
+        document.worlds[article->world].push_back(article);
+        document.categories[article->category].push_back(article);
+    }
+}
+
+ManifestEntry makeManifestEntry(const Article *article, const ErrorLog &articleLog) {
+    ManifestEntry entry;
+    entry.sourceFile = article->sourceFile;
+    entry.filename = article->filename;
+    entry.name = article->name;
+    entry.world = article->world;
+    entry.category = article->category;
+    entry.hasPageInfo = article->hasPageInfo;
+    entry.sourceSize = article->sourceSize;
+    entry.sourceHash = article->sourceHash;
+    entry.headerHash = 0;
+    entry.referenceHash = 0;
+    entry.labels = article->labels;
+    entry.references = article->references;
+    entry.images = article->images;
+    for (const ErrorMsg &msg : articleLog.errors) {
+        if (msg.type == ErrorType::Warning) entry.warnings.push_back(msg.message);
+    }
+    return entry;
+}
+
+// Hash where each of an article's \pageref targets currently points, which
+// articles refer to it and the copies of the images it shows, so a page is
+// rendered again when a label it references moves, its "Referenced by" list
+// changes or one of its images does.
+unsigned long long hashReferences(const Document &document, const Article *article) {
+    unsigned long long hash = HASH_SEED;
+    for (const Reference &reference : article->references) {
+        auto iter = document.links.find(reference.target);
+        if (iter == document.links.end()) {
+            hash = hashText("?", hash);
+        } else {
+            hash = hashText(iter->second.targetPage, hash);
+            hash = hashText(iter->second.isFragment ? "#" : "", hash);
+        }
+        hash = hashText("\n", hash);
+    }
+    for (const std::string &name : article->images) {
+        auto iter = document.images.find(name);
+        if (iter == document.images.end() || !iter->second.found) {
+            hash = hashText("!\n", hash);
+        } else {
+            const ImageAsset &image = iter->second;
+            hash = hashText(image.output + '\t' + std::to_string(image.width) + 'x' + std::to_string(image.height) + '\n', hash);
+        }
+    }
+    for (const Backlink &backlink : article->referencedBy) {
+        hash = hashText("<" + backlink.from->filename + '#' + backlink.reference->anchor + '\t' + backlink.from->name + '\n', hash);
+    }
+    return hash;
+}
+
+// Hash everything the index pages are built from.
+unsigned long long hashIndexInputs(Document &document) {
+    unsigned long long hash = HASH_SEED;
+    for (const auto &iter : document.links) {
+        const LinkTarget &target = iter.second;
+        hash = hashText(target.name + '\t' + target.displayText + '\t' + target.targetPage, hash);
+        hash = hashText(target.isFragment ? "\t1" : "\t0", hash);
+        Article *toPage = target.article;
+        if (toPage) {
+            hash = hashText('\t' + toPage->world + '\t' + toPage->category, hash);
+        }
+        hash = hashText("\n", hash);
+    }
+    return hash;
+}
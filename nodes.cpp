@@ -1,82 +1,140 @@
-#include "latexwiki.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
 
-Node::~Node() {
-    for (Node *node : children) delete node;
-}
+#include "latexwiki.h"
 
-void Node::add(Node *n) {
-    if (!n) return;
-    children.push_back(n);
-}
+Arena::Arena(std::size_t blockSize)
+: blockSize(blockSize), next(nullptr), remaining(0)
+{ }
 
-void Node::add(Fragment *n) {
-    if (!n) {
-        children.push_back(new Text(""));
-        return;
-    }
-    if (n->size() == 1) {
-        children.push_back(n->children[0]);
-        n->children.clear();
-        delete n;
-    } else {
-        children.push_back(n);
-    }
+Arena::~Arena() {
+    clear();
 }
 
-bool Node::isEmpty() const {
-    return children.empty();
+void* Arena::allocate(std::size_t size, std::size_t align) {
+    std::size_t padding = (align - reinterpret_cast<std::uintptr_t>(next) % align) % align;
+    if (padding + size > remaining) {
+        std::size_t newBlockSize = size + align > blockSize ? size + align : blockSize;
+        char *block = static_cast<char*>(std::malloc(newBlockSize));
+        if (!block) throw std::bad_alloc();
+        blocks.push_back(block);
+        next = block;
+        remaining = newBlockSize;
+        padding = (align - reinterpret_cast<std::uintptr_t>(next) % align) % align;
     }
-
-int Node::size() const {
-    return children.size();
+    void *result = next + padding;
+    next += padding + size;
+    remaining -= padding + size;
+    return result;
 }
 
-Node* Node::at(unsigned idx) {
-    if (idx >= children.size()) return nullptr;
-    return children[idx];
+void Arena::clear() {
+    for (char *block : blocks) std::free(block);
+    blocks.clear();
+    next = nullptr;
+    remaining = 0;
 }
 
 
-Text::Text(const std::string &s)
-: text(s)
+// A tree's nodes are allocated once, at their final size, so its arena has
+// no use for spare room.
+SyntaxTree::SyntaxTree()
+: nodes(nullptr), count(0), textBase(""), arena(0)
 { }
 
-void Text::handle(DocumentProcessor *processor) {
-    processor->handle(this);
+void SyntaxTree::clear() {
+    arena.clear();
+    nodes = nullptr;
+    count = 0;
+    textBase = "";
+}
+
+// Copy the nodes the parser built into the tree's own storage, so the
+// parser can keep reusing its buffer.
+void SyntaxTree::setNodes(const std::vector<Node> &built, const char *newTextBase) {
+    arena.clear();
+    Node *copy = static_cast<Node*>(arena.allocate(built.size() * sizeof(Node), alignof(Node)));
+    if (!built.empty()) std::memcpy(copy, built.data(), built.size() * sizeof(Node));
+    nodes = copy;
+    count = built.size();
+    textBase = newTextBase;
+}
+
+void SyntaxTree::setNodes(const Node *mapped, unsigned mappedCount, const char *newTextBase) {
+    arena.clear();
+    nodes = mapped;
+    count = mappedCount;
+    textBase = newTextBase;
 }
 
-void Fragment::handle(DocumentProcessor *processor) {
-    processor->handle(this);
+unsigned SyntaxTree::childCount(unsigned node) const {
+    unsigned result = 0;
+    for (unsigned c = node + 1; c < nodes[node].next; c = nodes[c].next) ++result;
+    return result;
 }
 
-void Command::handle(DocumentProcessor *processor) {
-    processor->handle(this);
+// The nth child of a node, or noNode if it has fewer children.
+unsigned SyntaxTree::child(unsigned node, unsigned n) const {
+    if (node == noNode) return noNode;
+    for (unsigned c = node + 1; c < nodes[node].next; c = nodes[c].next) {
+        if (n-- == 0) return c;
+    }
+    return noNode;
 }
 
-void Paragraph::handle(DocumentProcessor *processor) {
-    processor->handle(this);
+std::string SyntaxTree::str(unsigned node) const {
+    return collapseLines(text(node));
 }
 
+DocumentProcessor::DocumentProcessor()
+: article(nullptr), errorLog(nullptr)
+{ }
+
+NavPosition::NavPosition()
+: listed(false), index(0), prev(nullptr), next(nullptr)
+{ }
+
 Article::Article()
-: hasPageInfo(false)
+: source(nullptr), cachedTree(nullptr), sourceSize(0), sourceHash(0), hasPageInfo(false), isLoaded(true)
 { }
 
 Article::~Article() {
-    for (Paragraph *p : paragraphs) delete p;
+    delete source;
+    delete cachedTree;
 }
 
-void Article::add(Paragraph *n) {
-    if (!n) return;
-    paragraphs.push_back(n);
+
+void Document::addArticle(Article *article) {
+    articles.push_back(article);
+    files.insert(std::make_pair(article->filename, article));
 }
 
-void Article::process(DocumentProcessor &processor) {
-    for (Paragraph *p : paragraphs) {
-        processor.handle(p);
+// Look up the article each link points into, and turn the \pageref targets
+// each article recorded while it was scanned into the list of articles
+// referring to each target. This is done once every article has been added,
+// so nothing afterwards needs to search for them.
+void Document::resolveLinks() {
+    for (auto &iter : links) {
+        iter.second.article = byFile(iter.second.targetPage);
+    }
+    for (Article *article : articles) article->referencedBy.clear();
+    for (Article *article : articles) {
+        for (const Reference &reference : article->references) {
+            auto iter = links.find(reference.target);
+            if (iter == links.end()) continue;
+            Article *target = iter->second.article;
+            if (!target || target == article) continue;
+            // articles are visited in order, so a repeat is always the last
+            if (!target->referencedBy.empty() && target->referencedBy.back().from == article) continue;
+            target->referencedBy.push_back(Backlink{article, &reference});
+        }
     }
 }
 
-
 void Document::addLink(const LinkTarget &target, ErrorLog &errorLog) {
     auto existing = links.find(target.name);
     if (existing != links.end()) {
@@ -87,11 +145,8 @@ void Document::addLink(const LinkTarget &target, ErrorLog &errorLog) {
     links.insert(std::make_pair(target.name, target));
 }
 
-Article* Document::byFile(const std::string &filename) {
-    for (Article *iter : articles) {
-        if (iter->filename == filename) {
-            return iter;
-        }
-    }
-    return nullptr;
+Article* Document::byFile(const std::string &filename) const {
+    auto iter = files.find(filename);
+    if (iter == files.end()) return nullptr;
+    return iter->second;
 }
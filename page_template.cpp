@@ -0,0 +1,49 @@
+#include <ostream>
+#include <string>
+
+#include "latexwiki.h"
+
+static const struct {
+    const char *name;
+    TemplateSlot slot;
+} slotNames[] = {
+    {   "%TITLE%",      TemplateSlot::Title     },
+    {   "%CATNAV%",     TemplateSlot::CatNav    },
+    {   "%WORLDNAV%",   TemplateSlot::WorldNav  },
+    {   "%GENTIME%",    TemplateSlot::GenTime   },
+};
+
+// Split the template text into literal segments and the slots between them.
+void PageTemplate::parse(const std::string &templateText) {
+    text = templateText;
+    segments.clear();
+
+    std::string::size_type start = 0, pos = 0;
+    while ((pos = text.find('%', pos)) != std::string::npos) {
+        bool matched = false;
+        for (const auto &slotName : slotNames) {
+            if (text.compare(pos, std::strlen(slotName.name), slotName.name) == 0) {
+                if (pos > start) segments.push_back(Segment{TemplateSlot::None, start, pos - start});
+                segments.push_back(Segment{slotName.slot, 0, 0});
+                pos += std::strlen(slotName.name);
+                start = pos;
+                matched = true;
+                break;
+            }
+        }
+        if (!matched) ++pos;
+    }
+    if (start < text.size()) segments.push_back(Segment{TemplateSlot::None, start, text.size() - start});
+}
+
+void PageTemplate::write(std::ostream &out, const PageFields &fields) const {
+    for (const Segment &segment : segments) {
+        switch (segment.slot) {
+            case TemplateSlot::None:        out.write(text.data() + segment.start, segment.length); break;
+            case TemplateSlot::Title:       out << fields.title;    break;
+            case TemplateSlot::CatNav:      out << fields.catNav;   break;
+            case TemplateSlot::WorldNav:    out << fields.worldNav; break;
+            case TemplateSlot::GenTime:     out << fields.genTime;  break;
+        }
+    }
+}
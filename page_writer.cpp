@@ -0,0 +1,362 @@
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "latexwiki.h"
+
+// Number of pages opened, written and closed together in one io_uring batch.
+static const unsigned uringBatchSize = 64;
+
+// Write a whole file with ordinary system calls.
+static bool writeFileSync(const std::string &filename, const std::string &content) {
+    TraceSpan span("io", "write", filename);
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    std::size_t done = 0;
+    while (done < content.size()) {
+        struct iovec chunk;
+        chunk.iov_base = const_cast<char*>(content.data() + done);
+        chunk.iov_len = content.size() - done;
+        ssize_t count = pwritev(fd, &chunk, 1, done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) {
+            close(fd);
+            return false;
+        }
+        done += count;
+    }
+    return close(fd) == 0;
+}
+
+
+// A minimal io_uring submission/completion ring driven directly through the
+// system calls, so no liburing is needed.
+struct Uring {
+    Uring();
+    ~Uring();
+    bool init(unsigned entries);
+    unsigned space() const;
+    bool reserve(unsigned count);
+    io_uring_sqe* nextSqe();
+    bool submitAndWait(unsigned count);
+    bool nextCqe(io_uring_cqe &cqe);
+    std::vector<unsigned long long> withdraw();
+
+    int fd;
+    void *sqRing, *cqRing;
+    std::size_t sqRingSize, cqRingSize, sqesSize;
+    io_uring_sqe *sqes;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+    unsigned queued;
+};
+
+Uring::Uring()
+: fd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqRingSize(0), cqRingSize(0),
+  sqesSize(0), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), queued(0)
+{ }
+
+Uring::~Uring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+    if (fd >= 0) close(fd);
+}
+
+bool Uring::init(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return false;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqRingSize > sqRingSize) sqRingSize = cqRingSize;
+        cqRingSize = sqRingSize;
+    }
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) return false;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqeMapping = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqeMapping == MAP_FAILED) return false;
+    sqes = static_cast<io_uring_sqe*>(sqeMapping);
+
+    char *sq = static_cast<char*>(sqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char *cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+// The number of entries that can still be queued before the kernel picks up
+// those already submitted.
+unsigned Uring::space() const {
+    unsigned used = *sqTail + queued - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    return *sqMask + 1 - used;
+}
+
+// Make room for count entries, submitting those already queued if the ring is
+// too full. Returns false if there is still no room.
+bool Uring::reserve(unsigned count) {
+    if (space() >= count) return true;
+    return submitAndWait(0) && space() >= count;
+}
+
+io_uring_sqe* Uring::nextSqe() {
+    unsigned tail = *sqTail + queued;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask) return nullptr;
+    unsigned index = tail & *sqMask;
+    sqArray[index] = index;
+    ++queued;
+    io_uring_sqe *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Submit every queued entry, along with any an earlier call failed to
+// submit, and wait until count completions are available.
+bool Uring::submitAndWait(unsigned count) {
+    __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+    queued = 0;
+    while (true) {
+        unsigned toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        int result = syscall(__NR_io_uring_enter, fd, toSubmit, count, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (result >= 0) return true;
+        if (errno != EINTR) return false;
+    }
+}
+
+bool Uring::nextCqe(io_uring_cqe &cqe) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) return false;
+    cqe = cqes[head & *cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Take back the entries the kernel has not picked up yet, so they never run.
+// Returns their user_data.
+std::vector<unsigned long long> Uring::withdraw() {
+    std::vector<unsigned long long> withdrawn;
+    __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+    queued = 0;
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    for (unsigned pos = head; pos != *sqTail; ++pos) {
+        withdrawn.push_back(sqes[sqArray[pos & *sqMask]].user_data);
+    }
+    __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+    return withdrawn;
+}
+
+
+PageWriter::PageWriter(unsigned threads, bool allowUring)
+: maxQueued(0), finishing(false), usingUring(false), uring(nullptr)
+{
+    if (allowUring) {
+        uring = new Uring;
+        if (uring->init(uringBatchSize * 2)) {
+            usingUring = true;
+        } else {
+            delete uring;
+            uring = nullptr;
+        }
+    }
+
+    if (usingUring) {
+        workers.push_back(std::thread([this]() { uringLoop(); }));
+    } else {
+        if (threads < 1) threads = 1;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.push_back(std::thread([this]() { syncLoop(); }));
+        }
+    }
+}
+
+PageWriter::~PageWriter() {
+    finish();
+    delete uring;
+}
+
+// Queue a page to be written; this returns without waiting for the disk,
+// unless maxQueued pages are already waiting.
+void PageWriter::submit(const std::string &filename, std::string &&content) {
+    std::unique_lock<std::mutex> guard(lock);
+    drained.wait(guard, [this]() { return maxQueued == 0 || queue.size() < maxQueued; });
+    queue.push_back(OutputPage{filename, std::move(content)});
+    ready.notify_one();
+}
+
+// Wait for every queued page to be written. Returns the names of the files
+// that could not be written.
+const std::vector<std::string>& PageWriter::finish() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        finishing = true;
+        ready.notify_all();
+    }
+    for (std::thread &worker : workers) worker.join();
+    workers.clear();
+    return failed;
+}
+
+// Take up to max pages from the queue, waiting for some if it is empty.
+// Returns false once the writer is finishing and nothing is left.
+bool PageWriter::takePages(std::vector<OutputPage> &pages, unsigned max) {
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [this]() { return finishing || !queue.empty(); });
+    if (queue.empty()) return false;
+    while (!queue.empty() && pages.size() < max) {
+        pages.push_back(std::move(queue.front()));
+        queue.pop_front();
+    }
+    drained.notify_all();
+    return true;
+}
+
+void PageWriter::addFailure(const std::string &filename) {
+    std::lock_guard<std::mutex> guard(lock);
+    failed.push_back(filename);
+}
+
+void PageWriter::syncLoop() {
+    std::vector<OutputPage> pages;
+    while (takePages(pages, 1)) {
+        if (!writeFileSync(pages[0].filename, pages[0].content)) addFailure(pages[0].filename);
+        pages.clear();
+    }
+}
+
+// Write pages in batches: one submission opens every file in the batch and a
+// second writes each file with its close linked after the write.
+void PageWriter::uringLoop() {
+    std::vector<OutputPage> pages;
+    while (takePages(pages, uringBatchSize)) {
+        TraceSpan span("io", "write batch");
+        // each request's user_data is three times its page's index, plus 0
+        // for the open, 1 for the write or 2 for the close
+        std::vector<int> fds(pages.size(), -1);
+        std::vector<char> written(pages.size(), false), closed(pages.size(), false);
+        unsigned inFlight = 0;
+        auto complete = [&](unsigned long long request, int result) {
+            unsigned i = request / 3;
+            switch (request % 3) {
+            case 0:
+                fds[i] = result;
+                break;
+            case 1:
+                written[i] = result >= 0 && static_cast<std::size_t>(result) == pages[i].content.size();
+                break;
+            case 2:
+                // -ECANCELED means the write came up short, so the linked
+                // close never ran
+                closed[i] = result != -ECANCELED;
+                break;
+            }
+            --inFlight;
+        };
+        // Handle completions until every request of the batch has finished.
+        // If the ring fails, whatever the kernel has not picked up is taken
+        // back and the rest is still waited for, since those requests refer
+        // to the pages' names and contents. Returns false if the ring failed,
+        // with inFlight left above 0 if even waiting failed.
+        bool ok = true;
+        auto finishRequests = [&]() {
+            io_uring_cqe cqe;
+            while (inFlight > 0) {
+                if (uring->nextCqe(cqe)) {
+                    complete(cqe.user_data, cqe.res);
+                } else if (!uring->submitAndWait(1)) {
+                    if (!ok) return;
+                    ok = false;
+                    for (unsigned long long request : uring->withdraw()) complete(request, -ECANCELED);
+                }
+            }
+        };
+
+        // pages that find no room in the ring are written the ordinary way
+        // below, as their files were never opened
+        for (unsigned i = 0; i < pages.size(); ++i) {
+            if (!uring->reserve(1)) break;
+            io_uring_sqe *sqe = uring->nextSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<unsigned long>(pages[i].filename.c_str());
+            sqe->len = 0644;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            sqe->user_data = i * 3;
+            ++inFlight;
+        }
+        finishRequests();
+
+        for (unsigned i = 0; ok && i < pages.size(); ++i) {
+            if (fds[i] < 0) continue;
+            // a write and its close are queued together so the link between
+            // them never spans two submissions
+            if (!uring->reserve(2)) break;
+            io_uring_sqe *sqe = uring->nextSqe();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fds[i];
+            sqe->addr = reinterpret_cast<unsigned long>(pages[i].content.data());
+            sqe->len = pages[i].content.size();
+            sqe->off = 0;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = i * 3 + 1;
+            sqe = uring->nextSqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fds[i];
+            sqe->user_data = i * 3 + 2;
+            inFlight += 2;
+        }
+        if (ok) finishRequests();
+
+        if (inFlight > 0) {
+            // The ring broke with requests outstanding. Closing it cancels
+            // them, but they may already have opened or truncated these
+            // files, so nothing is written over them or closed under them.
+            for (const OutputPage &page : pages) addFailure(page.filename);
+            delete uring;
+            uring = nullptr;
+            pages.clear();
+            syncLoop();
+            return;
+        }
+        for (unsigned i = 0; i < pages.size(); ++i) {
+            if (fds[i] >= 0 && !closed[i]) close(fds[i]);
+        }
+        // anything the ring could not handle is written the ordinary way
+        for (unsigned i = 0; i < pages.size(); ++i) {
+            if (written[i]) continue;
+            if (!writeFileSync(pages[i].filename, pages[i].content)) addFailure(pages[i].filename);
+        }
+        pages.clear();
+        if (!ok) {
+            delete uring;
+            uring = nullptr;
+            syncLoop();
+            return;
+        }
+    }
+}
@@ -9,87 +9,108 @@ ScanDocument::ScanDocument(Document *document)
 : document(document)
 { }
 
-void ScanDocument::handle(Node *node) {
-    if (node) node->handle(this);
-}
-
-void ScanDocument::handle(Fragment *fragment) {
-    for (Node *c : fragment->children) {
-        handle(c);
+// Only commands matter to the scan, so it runs straight through the nodes of
+// the paragraph in order, skipping the contents of the commands that do not
+// want them scanned.
+void ScanDocument::handle(unsigned paragraph) {
+    const Node *nodes = article->tree.nodes;
+    for (unsigned node = paragraph + 1; node < nodes[paragraph].next; ) {
+        if (nodes[node].kind == NodeKind::Command && !handleCommand(node)) node = nodes[node].next;
+        else ++node;
     }
 }
 
-void ScanDocument::handle(Text *text) {
-}
-
-void ScanDocument::handle(Command *command) {
-    if (command->command == "label") {
+// Record what a command adds to the document. Returns false if the nodes
+// inside the command are not to be scanned.
+bool ScanDocument::handleCommand(unsigned command) {
+    const SyntaxTree &tree = article->tree;
+    switch (tree.nodes[command].id) {
+    case CommandId::label: {
         errorLog->add(ErrorType::Warning, article->sourceFile, "Avoid use of \\label command.");
-        Text *name = dynamic_cast<Text*>(command->children[0]);
-        if (!name) {
+        unsigned name = tree.child(command, 0);
+        if (!tree.isText(name)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Label text may not contain commands.");
-            return;
+            return false;
         }
 
-        LinkTarget entry = { name->text, article->filename, name->text, true };
-        document->addLink(entry, *errorLog);
-    } else if (command->command == "addlabel") {
-        Text *name = dynamic_cast<Text*>(command->at(0));
-        if (!name) {
+        LinkTarget entry = { tree.str(name), article->filename, tree.str(name), true, nullptr };
+        article->labels.push_back(entry);
+        if (document) document->addLink(entry, *errorLog);
+        break; }
+    case CommandId::addlabel: {
+        unsigned name = tree.child(command, 0);
+        if (!tree.isText(name)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Label text may not contain commands.");
-            return;
+            return false;
         }
-        Text *target = dynamic_cast<Text*>(command->at(1));
-        if (!target) {
+        unsigned target = tree.child(command, 1);
+        if (!tree.isText(target)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Label target may not contain commands.");
-            return;
+            return false;
         }
 
-        LinkTarget entry = { target->text, article->filename, name->text, true };
-        document->addLink(entry, *errorLog);
-    } else if (command->command == "pageinfo") {
+        LinkTarget entry = { tree.str(target), article->filename, tree.str(name), true, nullptr };
+        article->labels.push_back(entry);
+        if (document) document->addLink(entry, *errorLog);
+        break; }
+    case CommandId::pageinfo: {
         article->hasPageInfo = true;
-        Text *title = dynamic_cast<Text*>(command->at(0));
-        if (!title) {
+        unsigned title = tree.child(command, 0);
+        if (!tree.isText(title)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Page title may not contain commands.");
-            return;
+            return false;
         }
-        article->name = title->text;
+        article->name = tree.str(title);
 
-        Text *name = dynamic_cast<Text*>(command->at(1));
-        if (!name) {
+        unsigned name = tree.child(command, 1);
+        if (!tree.isText(name)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Page label may not contain commands.");
-            return;
+            return false;
         }
 
-        LinkTarget entry = { name->text, article->filename, article->name, false };
-        document->addLink(entry, *errorLog);
+        LinkTarget entry = { tree.str(name), article->filename, article->name, false, nullptr };
+        article->labels.push_back(entry);
+        if (document) document->addLink(entry, *errorLog);
 
-        Text *world = dynamic_cast<Text*>(command->at(2));
-        if (!world) {
+        unsigned world = tree.child(command, 2);
+        if (!tree.isText(world)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Page world may not contain commands.");
-            return;
+            return false;
         }
-        article->world = world->text;
-        document->worlds[world->text].push_back(article);
+        article->world = tree.str(world);
+        if (document) document->worlds[article->world].push_back(article);
 
-        Text *category = dynamic_cast<Text*>(command->at(3));
-        if (!category) {
+        unsigned category = tree.child(command, 3);
+        if (!tree.isText(category)) {
             errorLog->add(ErrorType::Error, article->sourceFile, "Page category may not contain commands.");
-            return;
+            return false;
         }
-        article->category = category->text;
-        document->categories[category->text].push_back(article);
+        article->category = tree.str(category);
+        if (document) document->categories[article->category].push_back(article);
+        break; }
 
-    } else {
-        for (Node *c : command->children) {
-            handle(c);
+    case CommandId::narrowimage:
+    case CommandId::mediumimage:
+    case CommandId::wideimage: {
+        unsigned name = tree.child(command, 0);
+        if (tree.isText(name)) article->images.push_back(tree.str(name));
+        return true; }
+
+    case CommandId::pageref: {
+        unsigned name = tree.child(command, 0);
+        if (!tree.isText(name)) return true;
+        Reference reference = { tree.str(name), std::string() };
+        for (auto label = article->labels.rbegin(); label != article->labels.rend(); ++label) {
+            if (label->isFragment) {
+                reference.anchor = label->name;
+                break;
+            }
         }
-    }
-}
+        article->references.push_back(reference);
+        return true; }
 
-void ScanDocument::handle(Paragraph *paragraph) {
-    for (Node *c : paragraph->children) {
-        handle(c);
+    default:
+        return true;
     }
+    return false;
 }
@@ -0,0 +1,533 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "latexwiki.h"
+
+static const char *searchDir = "out/search";
+static const char *termsDir = "out/.search";
+static const char *termsHeader = "latexwiki-terms 1";
+// Articles listed in each documents file of the index.
+static const unsigned docsPerShard = 1000;
+static const std::size_t minTermLength = 2;
+static const std::size_t maxTermLength = 32;
+// How much a word of an article's title counts for; see also headingWeight().
+static const unsigned titleWeight = 10;
+
+// Words too common to be worth an entry; the script skips them in queries.
+static const char *stopWords[] = {
+    "an", "and", "are", "as", "at", "be", "but", "by", "for", "from", "had", "has", "have",
+    "he", "her", "his", "in", "into", "is", "it", "its", "of", "on", "or", "she", "that",
+    "the", "their", "them", "there", "they", "this", "to", "was", "were", "which", "with"
+};
+
+// The longest of the stop words; longer words are never looked up.
+static const std::size_t maxStopWordLength = 5;
+
+// A word of at most eight bytes as one number, so short words compare as
+// integers.
+static std::uint64_t packWord(const char *word, std::size_t length) {
+    std::uint64_t packed = 0;
+    for (std::size_t i = 0; i < length; ++i) packed = packed << 8 | static_cast<unsigned char>(word[i]);
+    return packed;
+}
+
+static bool isStopWord(const char *term, std::size_t length) {
+    static const std::vector<std::uint64_t> packed = []() {
+        std::vector<std::uint64_t> words;
+        for (const char *word : stopWords) words.push_back(packWord(word, std::strlen(word)));
+        std::sort(words.begin(), words.end());
+        return words;
+    }();
+    return std::binary_search(packed.begin(), packed.end(), packWord(term, length));
+}
+
+// Letters, digits and anything outside ASCII make up words; ASCII letters are
+// folded to lower case. search.js splits queries the same way. Each byte maps
+// to itself folded, or to 0 if it is not part of a word.
+struct WordBytes {
+    WordBytes();
+    unsigned char fold[256];
+};
+
+WordBytes::WordBytes() {
+    for (unsigned c = 0; c < 256; ++c) {
+        bool word = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+        fold[c] = !word ? 0 : c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+}
+
+static const WordBytes wordBytes;
+
+static const std::uint32_t fnvOffset = 2166136261u;
+static const std::uint32_t fnvPrime = 16777619u;
+
+// Mix the anchor a word counts towards into the FNV-1a hash of the word.
+static std::uint32_t anchorHash(std::uint32_t hash, unsigned anchor) {
+    return hash ^ (anchor * 0x9E3779B9u);
+}
+
+// Where each entry of the article being collected on this thread is in its
+// terms, one past its index, by hash; 0 marks a free slot. The table is kept
+// at most half full. It is reused from article to article so it is not
+// allocated again for each, and rebuilt when another article's words are
+// added on the thread.
+struct TermTable {
+    TermTable();
+    void reset(const SearchTerms *terms);
+    void insert(std::uint32_t hash, unsigned entry);
+
+    const SearchTerms *owner;
+    std::vector<std::pair<std::uint32_t, unsigned>> slots;
+};
+
+TermTable::TermTable()
+: owner(nullptr), slots(1024)
+{ }
+
+void TermTable::reset(const SearchTerms *terms) {
+    owner = terms;
+    std::size_t size = slots.size();
+    while (size < terms->terms.size() * 2 + 2) size *= 2;
+    slots.assign(size, std::make_pair(0u, 0u));
+    for (unsigned i = 0; i < terms->terms.size(); ++i) {
+        const SearchTerm &term = terms->terms[i];
+        std::uint32_t hash = fnvOffset;
+        for (char c : term.term) hash = (hash ^ static_cast<unsigned char>(c)) * fnvPrime;
+        insert(anchorHash(hash, term.anchor), i + 1);
+    }
+}
+
+void TermTable::insert(std::uint32_t hash, unsigned entry) {
+    std::size_t i = hash & (slots.size() - 1);
+    while (slots[i].second != 0) i = (i + 1) & (slots.size() - 1);
+    slots[i] = std::make_pair(hash, entry);
+}
+
+static thread_local TermTable termTable;
+
+SearchTerms::SearchTerms()
+: anchors(1), anchor(0)
+{ }
+
+void SearchTerms::clear() {
+    anchors.assign(1, std::string());
+    anchor = 0;
+    terms.clear();
+    if (termTable.owner == this) termTable.owner = nullptr;
+}
+
+// Words after this count towards the anchor with the given name.
+void SearchTerms::addAnchor(const std::string &name) {
+    anchors.push_back(name);
+    anchor = anchors.size() - 1;
+}
+
+void SearchTerms::add(StringView text, unsigned weight) {
+    TermTable &table = termTable;
+    if (table.owner != this) table.reset(this);
+    // the word folded to lower case
+    char term[maxTermLength];
+    for (std::size_t pos = 0; pos < text.size; ) {
+        while (pos < text.size && !wordBytes.fold[static_cast<unsigned char>(text.data[pos])]) ++pos;
+        const std::size_t start = pos;
+        std::uint32_t hash = fnvOffset;
+        while (pos < text.size) {
+            const unsigned char c = wordBytes.fold[static_cast<unsigned char>(text.data[pos])];
+            if (!c) break;
+            if (pos - start < maxTermLength) term[pos - start] = c;
+            hash = (hash ^ c) * fnvPrime;
+            ++pos;
+        }
+        const std::size_t length = pos - start;
+        if (length < minTermLength || length > maxTermLength) continue;
+        if (length <= maxStopWordLength && isStopWord(term, length)) continue;
+
+        hash = anchorHash(hash, anchor);
+        std::size_t i = hash & (table.slots.size() - 1);
+        bool found = false;
+        for (; table.slots[i].second != 0; i = (i + 1) & (table.slots.size() - 1)) {
+            if (table.slots[i].first != hash) continue;
+            SearchTerm &existing = terms[table.slots[i].second - 1];
+            if (existing.anchor == anchor && existing.term.size() == length && std::memcmp(existing.term.data(), term, length) == 0) {
+                existing.weight += weight;
+                found = true;
+                break;
+            }
+        }
+        if (found) continue;
+        terms.push_back(SearchTerm{std::string(term, length), anchor, weight});
+        if (terms.size() * 2 >= table.slots.size()) {
+            table.reset(this);
+        } else {
+            table.slots[i] = std::make_pair(hash, static_cast<unsigned>(terms.size()));
+        }
+    }
+}
+
+void SearchTerms::addTitle(const std::string &title) {
+    add(StringView(title.data(), title.size()), titleWeight);
+}
+
+// Drop what was only needed while collecting.
+void SearchTerms::finish() {
+    if (termTable.owner == this) termTable.owner = nullptr;
+    terms.shrink_to_fit();
+}
+
+bool SearchTerms::operator==(const SearchTerms &other) const {
+    if (anchors != other.anchors || terms.size() != other.terms.size()) return false;
+    for (unsigned i = 0; i < terms.size(); ++i) {
+        const SearchTerm &left = terms[i], &right = other.terms[i];
+        if (left.term != right.term || left.anchor != right.anchor || left.weight != right.weight) return false;
+    }
+    return true;
+}
+
+// How much a word counts for inside the heading a command writes.
+unsigned headingWeight(CommandId id) {
+    switch (id) {
+        case CommandId::chapter:
+        case CommandId::section:        return 5;
+        case CommandId::subsection:
+        case CommandId::subsubsection:  return 3;
+        default:                        return 1;
+    }
+}
+
+
+static std::string termsPath(const std::string &filename) {
+    std::string::size_type dot = filename.rfind('.');
+    return termsDir + ("/" + filename.substr(0, dot)) + ".terms";
+}
+
+bool haveSearchTerms(const Article *article) {
+    return fileExists(termsPath(article->filename));
+}
+
+// Keep the words of a rendered article, so the search index can be built
+// again without rendering it. They are written through output, in the
+// background, if it is given. Failing only means the article is rendered
+// again next time, so it is not reported.
+void saveSearchTerms(const Article *article, const SearchTerms &terms, PageOutput *output) {
+    mkdir(termsDir, 0755);
+    std::ostringstream text;
+    text << termsHeader << '\n';
+    for (unsigned i = 1; i < terms.anchors.size(); ++i) {
+        text << "anchor\t" << terms.anchors[i] << '\n';
+    }
+    for (const SearchTerm &term : terms.terms) {
+        text << "term\t" << term.term << '\t' << term.anchor << '\t' << term.weight << '\n';
+    }
+    if (output) {
+        output->submit(termsPath(article->filename), text.str());
+        return;
+    }
+    std::ofstream out(termsPath(article->filename));
+    if (!out) return;
+    out << text.str();
+    if (!out) {
+        out.close();
+        std::remove(termsPath(article->filename).c_str());
+    }
+}
+
+bool loadSearchTerms(const Article *article, SearchTerms &terms) {
+    terms.clear();
+    std::ifstream in(termsPath(article->filename));
+    std::string line;
+    if (!std::getline(in, line) || line != termsHeader) return false;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 7, "anchor\t") == 0) {
+            terms.anchors.push_back(line.substr(7));
+        } else if (line.compare(0, 5, "term\t") == 0) {
+            std::istringstream fields(line.substr(5));
+            SearchTerm term;
+            if (!std::getline(fields, term.term, '\t') || term.term.empty()) return false;
+            if (!(fields >> term.anchor >> term.weight) || term.anchor >= terms.anchors.size()) return false;
+            terms.terms.push_back(term);
+        } else {
+            return false;
+        }
+    }
+    terms.finish();
+    return true;
+}
+
+void removeSearchTerms(const std::string &filename) {
+    std::remove(termsPath(filename).c_str());
+}
+
+
+struct Posting {
+    unsigned doc, weight;
+    const std::string *anchor;
+};
+
+// Terms are sharded by their first two bytes.
+static const unsigned shardCount = 256 * 256;
+
+static unsigned shardOf(const std::string &term) {
+    return static_cast<unsigned char>(term[0]) * 256 + static_cast<unsigned char>(term[1]);
+}
+
+SearchIndexChanges::SearchIndexChanges()
+: all(true)
+{ }
+
+// Each word of an article with the anchors it appears at and their weights,
+// in the order the article lists them, which is the order a shard lists them
+// in among postings of the same weight.
+typedef std::map<std::string, std::vector<std::pair<std::string, unsigned>>> ArticlePostings;
+
+static ArticlePostings postingsOf(const SearchTerms &terms) {
+    ArticlePostings postings;
+    for (const SearchTerm &term : terms.terms) {
+        postings[term.term].push_back(std::make_pair(terms.anchors[term.anchor], term.weight));
+    }
+    return postings;
+}
+
+// The shards holding the words whose postings differ between two versions of
+// an article need writing again.
+void SearchIndexChanges::addChangedTerms(const SearchTerms &before, const SearchTerms &after) {
+    const ArticlePostings left = postingsOf(before), right = postingsOf(after);
+    auto old = left.begin();
+    auto now = right.begin();
+    while (old != left.end() || now != right.end()) {
+        if (now == right.end() || (old != left.end() && old->first < now->first)) {
+            shards.insert(shardOf(old->first));
+            ++old;
+        } else if (old == left.end() || now->first < old->first) {
+            shards.insert(shardOf(now->first));
+            ++now;
+        } else {
+            if (old->second != now->second) shards.insert(shardOf(now->first));
+            ++old;
+            ++now;
+        }
+    }
+}
+
+// The documents file listing an article needs writing again.
+void SearchIndexChanges::addDocument(unsigned doc) {
+    documentFiles.insert(doc / docsPerShard);
+}
+
+// The file a shard is kept in, named after the bytes its terms start with.
+// Bytes other than lower case letters and digits are written in hex.
+static std::string shardName(unsigned shard) {
+    std::string name = "terms-";
+    for (unsigned char c : { static_cast<unsigned char>(shard / 256), static_cast<unsigned char>(shard % 256) }) {
+        if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+            name += c;
+        } else {
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "_%02x", c);
+            name += hex;
+        }
+    }
+    return name + ".json";
+}
+
+// The terms of one shard, each with the articles and anchors it appears at.
+typedef std::map<std::string, std::vector<Posting>> ShardTerms;
+
+// A shard lists its terms in order, each with the articles and anchors it
+// appears at, heaviest first.
+static std::string writeShard(ShardTerms &dictionary) {
+    std::ostringstream json;
+    json << '{';
+    bool first = true;
+    for (auto &iter : dictionary) {
+        std::vector<Posting> &postings = iter.second;
+        std::stable_sort(postings.begin(), postings.end(), [](const Posting &left, const Posting &right) {
+            return left.weight > right.weight;
+        });
+        json << (first ? "\n\"" : ",\n\"") << escapeJson(iter.first) << "\":[";
+        first = false;
+        for (unsigned j = 0; j < postings.size(); ++j) {
+            const Posting &posting = postings[j];
+            json << (j ? ",[" : "[") << posting.doc << ',' << posting.weight;
+            if (!posting.anchor->empty()) json << ",\"" << escapeJson(*posting.anchor) << '"';
+            json << ']';
+        }
+        json << ']';
+    }
+    json << "\n}\n";
+    return json.str();
+}
+
+// Write the documents files listing the articles by number, unless changes
+// leaves them out, and the file describing the index. Their names are added
+// to written.
+static void writeDocuments(const Document &document, const SearchIndexChanges &changes, std::set<std::string> &written, PageOutput &output) {
+    const std::string prefix = std::string(searchDir) + "/";
+    for (unsigned first = 0; first < document.articles.size(); first += docsPerShard) {
+        const std::string name = "docs-" + std::to_string(first / docsPerShard) + ".json";
+        written.insert(name);
+        if (!changes.all && changes.documentFiles.count(first / docsPerShard) == 0) continue;
+        std::ostringstream json;
+        json << '[';
+        for (unsigned doc = first; doc < document.articles.size() && doc < first + docsPerShard; ++doc) {
+            const Article *article = document.articles[doc];
+            json << (doc > first ? ",\n[\"" : "\n[\"") << escapeJson(article->filename) << "\",\"" << escapeJson(article->name) << "\"]";
+        }
+        json << "\n]\n";
+        output.submit(prefix + name, json.str());
+    }
+
+    std::ostringstream json;
+    json << "{\"documents\":" << document.articles.size() << ",\"docsPerShard\":" << docsPerShard;
+    json << ",\"minTermLength\":" << minTermLength;
+    json << ",\"maxTermLength\":" << maxTermLength << ",\"stopWords\":[";
+    for (unsigned i = 0; i < sizeof(stopWords) / sizeof(stopWords[0]); ++i) {
+        json << (i ? ",\"" : "\"") << stopWords[i] << '"';
+    }
+    json << "]}\n";
+    output.submit(prefix + "index.json", json.str());
+    written.insert("index.json");
+}
+
+// Remove the files of the index not in written, such as shards for words no
+// article has any more, and their compressed copies.
+static void removeStaleIndexFiles(const std::set<std::string> &written) {
+    const std::string prefix = std::string(searchDir) + "/";
+    DIR *dir = opendir(searchDir);
+    if (!dir) return;
+    while (struct dirent *entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name == "." || name == ".." || written.count(uncompressedName(name)) != 0) continue;
+        std::remove((prefix + name).c_str());
+    }
+    closedir(dir);
+}
+
+// Write the search index read by search.js. The words of each article were
+// collected while it was rendered, or loaded from what was kept the last time
+// it was. The dictionary is split into shards by the first bytes of each
+// term, so a query only fetches the shards of its own words. Articles are
+// referred to by number and listed in separate documents files. Unless
+// changes.all is set, only the files it names are written or removed.
+void writeSearchIndex(const Document &document, const std::vector<const SearchTerms*> &terms, const SearchIndexChanges &changes, PageOutput &output) {
+    TraceSpan span("index", "search");
+    mkdir(searchDir, 0755);
+    const std::string prefix = std::string(searchDir) + "/";
+    std::set<std::string> written;
+
+    // each shard's (article, term) pairs; the shards are then written in
+    // parallel
+    std::vector<char> wanted(shardCount, changes.all);
+    for (unsigned shard : changes.shards) wanted[shard] = true;
+    std::vector<std::vector<std::pair<unsigned, unsigned>>> entries(shardCount);
+    for (unsigned doc = 0; doc < terms.size(); ++doc) {
+        for (unsigned i = 0; i < terms[doc]->terms.size(); ++i) {
+            const unsigned shard = shardOf(terms[doc]->terms[i].term);
+            if (wanted[shard]) entries[shard].push_back(std::make_pair(doc, i));
+        }
+    }
+    std::vector<unsigned> shards;
+    for (unsigned shard = 0; shard < shardCount; ++shard) {
+        if (!wanted[shard]) continue;
+        if (!entries[shard].empty()) {
+            shards.push_back(shard);
+            written.insert(shardName(shard));
+        } else if (!changes.all) {
+            // no article has words in this shard any more
+            std::remove((prefix + shardName(shard)).c_str());
+            removeCompressedCopies(prefix + shardName(shard));
+        }
+    }
+    runParallel(shards.size(), jobCount, [&](unsigned n) {
+        ShardTerms dictionary;
+        for (const auto &entry : entries[shards[n]]) {
+            const SearchTerms &article = *terms[entry.first];
+            const SearchTerm &term = article.terms[entry.second];
+            dictionary[term.term].push_back(Posting{entry.first, term.weight, &article.anchors[term.anchor]});
+        }
+        output.submit(prefix + shardName(shards[n]), writeShard(dictionary));
+    });
+
+    writeDocuments(document, changes, written, output);
+    if (changes.all) removeStaleIndexFiles(written);
+}
+
+static std::string bucketPath(unsigned char first) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/bucket-%02x.tmp", first);
+    return termsDir + std::string(name);
+}
+
+// Write the whole search index without holding every article's words at
+// once. collect gives the words of one article at a time, which are spread
+// over bucket files in out/.search by the first byte of each term. Each
+// bucket is then read back on its own and its shards are written, so only
+// the words sharing a first byte are ever in memory together. The index is
+// the same as writeSearchIndex() writes.
+void streamSearchIndex(const Document &document, const std::function<bool(unsigned, SearchTerms&)> &collect, PageOutput &output) {
+    TraceSpan span("index", "search");
+    mkdir(searchDir, 0755);
+    mkdir(termsDir, 0755);
+    const std::string prefix = std::string(searchDir) + "/";
+    std::set<std::string> written;
+
+    // a line per term: the term, the article, its weight and its anchor
+    std::vector<std::unique_ptr<std::ofstream>> buckets(256);
+    SearchTerms terms;
+    for (unsigned doc = 0; doc < document.articles.size(); ++doc) {
+        if (!collect(doc, terms)) continue;
+        for (const SearchTerm &term : terms.terms) {
+            const unsigned char first = term.term[0];
+            if (!buckets[first]) buckets[first].reset(new std::ofstream(bucketPath(first)));
+            *buckets[first] << term.term << '\t' << doc << '\t' << term.weight << '\t' << terms.anchors[term.anchor] << '\n';
+        }
+    }
+    terms.clear();
+
+    for (unsigned first = 0; first < buckets.size(); ++first) {
+        if (!buckets[first]) continue;
+        buckets[first].reset();
+        std::vector<ShardTerms> dictionaries(256);
+        // postings point at their anchor, which a deque never moves
+        std::deque<std::string> anchors;
+        std::ifstream in(bucketPath(first));
+        std::string line;
+        while (std::getline(in, line)) {
+            std::string::size_type tab1 = line.find('\t');
+            std::string::size_type tab2 = line.find('\t', tab1 + 1);
+            std::string::size_type tab3 = line.find('\t', tab2 + 1);
+            if (tab1 < minTermLength || tab3 == std::string::npos) continue;
+            const unsigned doc = std::strtoul(line.c_str() + tab1 + 1, nullptr, 10);
+            const unsigned weight = std::strtoul(line.c_str() + tab2 + 1, nullptr, 10);
+            anchors.push_back(line.substr(tab3 + 1));
+            line.resize(tab1);
+            dictionaries[static_cast<unsigned char>(line[1])][line].push_back(Posting{doc, weight, &anchors.back()});
+        }
+        in.close();
+        std::remove(bucketPath(first).c_str());
+
+        std::vector<unsigned> shards;
+        for (unsigned second = 0; second < dictionaries.size(); ++second) {
+            if (!dictionaries[second].empty()) shards.push_back(first * 256 + second);
+        }
+        runParallel(shards.size(), jobCount, [&](unsigned n) {
+            output.submit(prefix + shardName(shards[n]), writeShard(dictionaries[shards[n] % 256]));
+        });
+        for (unsigned shard : shards) written.insert(shardName(shard));
+    }
+
+    writeDocuments(document, SearchIndexChanges(), written, output);
+    removeStaleIndexFiles(written);
+}
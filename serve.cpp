@@ -0,0 +1,455 @@
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "latexwiki.h"
+
+// Rendered pages are dropped, least recently used first, once the cache holds
+// more than this many bytes.
+static const std::size_t cacheLimit = 64 * 1024 * 1024;
+// Requests with headers longer than this are refused.
+static const std::size_t maxRequestSize = 16 * 1024;
+// Clients that have not sent their whole request headers after this long,
+// such as sockets a browser opened in case it needed them, are dropped.
+static const std::chrono::seconds requestTimeout(10);
+
+struct CachedPage {
+    std::string content;
+    std::string etag;
+};
+
+static std::string makeETag(const std::string &content) {
+    std::stringstream etag;
+    etag << '"' << std::hex << hashText(content) << '"';
+    return etag.str();
+}
+
+// The most recently requested pages, kept so a page that has not changed is
+// not rendered again for every request.
+struct PageCache {
+    PageCache(std::size_t limit);
+    const CachedPage* find(const std::string &name);
+    const CachedPage* insert(const std::string &name, std::string &&content);
+
+    typedef std::list<std::pair<std::string, CachedPage>> PageList;
+    PageList pages;
+    std::unordered_map<std::string, PageList::iterator> byName;
+    std::size_t size, limit;
+};
+
+PageCache::PageCache(std::size_t limit)
+: size(0), limit(limit)
+{ }
+
+const CachedPage* PageCache::find(const std::string &name) {
+    auto iter = byName.find(name);
+    if (iter == byName.end()) return nullptr;
+    pages.splice(pages.begin(), pages, iter->second);
+    return &iter->second->second;
+}
+
+const CachedPage* PageCache::insert(const std::string &name, std::string &&content) {
+    CachedPage page;
+    page.etag = makeETag(content);
+    page.content = std::move(content);
+    size += page.content.size();
+    pages.push_front(std::make_pair(name, std::move(page)));
+    byName[name] = pages.begin();
+    // the page just added is never dropped, however large it is
+    while (size > limit && pages.size() > 1) {
+        size -= pages.back().second.content.size();
+        byName.erase(pages.back().first);
+        pages.pop_back();
+    }
+    return &pages.front().second;
+}
+
+// Collects the index pages in memory instead of writing them out. The pages
+// are built concurrently, so submitting them is locked.
+struct IndexPages : public PageOutput {
+    virtual void submit(const std::string &filename, std::string &&content) override;
+
+    std::mutex lock;
+    std::map<std::string, CachedPage> pages;
+};
+
+void IndexPages::submit(const std::string &filename, std::string &&content) {
+    std::string name = filename;
+    if (name.compare(0, 4, "out/") == 0) name.erase(0, 4);
+    std::lock_guard<std::mutex> guard(lock);
+    CachedPage &page = pages[name];
+    page.etag = makeETag(content);
+    page.content = std::move(content);
+}
+
+
+struct Request {
+    std::string method, path;
+    std::map<std::string, std::string> headers;
+};
+
+// A client whose request headers have not all arrived yet.
+struct Connection {
+    Connection(int fd, std::chrono::steady_clock::time_point deadline);
+
+    int fd;
+    std::string data;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+Connection::Connection(int fd, std::chrono::steady_clock::time_point deadline)
+: fd(fd), deadline(deadline)
+{ }
+
+struct Server {
+    Server(Builder &builder);
+    ~Server();
+    bool listen(unsigned short port);
+    void handle(int client, const std::string &data);
+    const CachedPage* findPage(const std::string &name, CachedPage &scratch);
+
+    Builder &builder;
+    int fd;
+    PageCache cache;
+    IndexPages indexes;
+    bool haveIndexes;
+};
+
+Server::Server(Builder &builder)
+: builder(builder), fd(-1), cache(cacheLimit), haveIndexes(false)
+{ }
+
+Server::~Server() {
+    if (fd >= 0) close(fd);
+}
+
+bool Server::listen(unsigned short port) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) return false;
+    return ::listen(fd, 64) == 0;
+}
+
+static bool sendAll(int client, const std::string &data) {
+    std::size_t done = 0;
+    while (done < data.size()) {
+        ssize_t count = send(client, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        done += count;
+    }
+    return true;
+}
+
+static void sendResponse(int client, const std::string &status, const std::string &headers, const std::string &body, bool withBody) {
+    std::stringstream response;
+    response << "HTTP/1.1 " << status << "\r\n";
+    response << headers;
+    response << "Content-Length: " << body.size() << "\r\n";
+    response << "Connection: close\r\n\r\n";
+    if (withBody) response << body;
+    sendAll(client, response.str());
+}
+
+static void sendError(int client, const std::string &status) {
+    sendResponse(client, status, "Content-Type: text/plain; charset=utf-8\r\n", status + "\n", true);
+}
+
+static std::string contentType(const std::string &name) {
+    std::string::size_type dot = name.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : name.substr(dot + 1);
+    for (char &c : extension) c = std::tolower(static_cast<unsigned char>(c));
+    if (extension == "html" || extension == "htm") return "text/html; charset=utf-8";
+    if (extension == "css") return "text/css; charset=utf-8";
+    if (extension == "js") return "text/javascript; charset=utf-8";
+    if (extension == "json") return "application/json";
+    if (extension == "png") return "image/png";
+    if (extension == "jpg" || extension == "jpeg") return "image/jpeg";
+    if (extension == "gif") return "image/gif";
+    if (extension == "svg") return "image/svg+xml";
+    if (extension == "otf") return "font/otf";
+    if (extension == "ttf") return "font/ttf";
+    if (extension == "woff") return "font/woff";
+    if (extension == "woff2") return "font/woff2";
+    return "application/octet-stream";
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Turn a request target into the name of a page or file under out/. Returns
+// false if the target is malformed or would leave the output directory.
+static bool targetToName(const std::string &target, std::string &name) {
+    std::string path = target.substr(0, target.find_first_of("?#"));
+    if (path.empty() || path[0] != '/') return false;
+    name.clear();
+    for (std::string::size_type i = 1; i < path.size(); ++i) {
+        if (path[i] == '%') {
+            if (i + 2 >= path.size()) return false;
+            int high = hexValue(path[i + 1]), low = hexValue(path[i + 2]);
+            if (high < 0 || low < 0) return false;
+            name += static_cast<char>(high * 16 + low);
+            i += 2;
+        } else {
+            name += path[i];
+        }
+    }
+    if (name.empty()) name = "index.html";
+    if (name.find('\0') != std::string::npos) return false;
+
+    std::string::size_type start = 0;
+    while (start <= name.size()) {
+        std::string::size_type end = name.find('/', start);
+        if (end == std::string::npos) end = name.size();
+        if (name.compare(start, end - start, "..") == 0 && end - start == 2) return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+// Parse the request line and headers of a request whose headers have all
+// been received.
+static bool parseRequest(const std::string &data, Request &request) {
+    std::istringstream lines(data.substr(0, data.find("\r\n\r\n")));
+    std::string line;
+    std::getline(lines, line);
+    std::istringstream requestLine(line);
+    std::string version;
+    if (!(requestLine >> request.method >> request.path >> version)) return false;
+    if (version.compare(0, 5, "HTTP/") != 0) return false;
+    while (std::getline(lines, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        std::string::size_type colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string key = line.substr(0, colon);
+        for (char &c : key) c = std::tolower(static_cast<unsigned char>(c));
+        std::string value = line.substr(colon + 1);
+        request.headers[key] = trim(value);
+    }
+    return true;
+}
+
+// Whether an If-None-Match header lists the given entity tag.
+static bool etagMatches(const std::string &header, const std::string &etag) {
+    std::string::size_type start = 0;
+    while (start < header.size()) {
+        std::string::size_type end = header.find(',', start);
+        if (end == std::string::npos) end = header.size();
+        std::string candidate = header.substr(start, end - start);
+        trim(candidate);
+        if (candidate == "*" || candidate == etag) return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+// Find the page with the given name: an article rendered on demand, one of the
+// index pages, an image under the name of its copy, or a file already in out/
+// or templates/ such as the style sheet. Files are read fresh each time and
+// returned through scratch.
+const CachedPage* Server::findPage(const std::string &name, CachedPage &scratch) {
+    const CachedPage *page = cache.find(name);
+    if (page) return page;
+
+    Article *article = builder.document.byFile(name);
+    if (article) {
+        PageFields fields;
+        makePageFields(article, fields);
+        fields.genTime = builder.genTime;
+        ErrorLog errorLog;
+        std::ostringstream content;
+        bool rendered = builder.renderArticle(article, fields, content, errorLog);
+        if (!errorLog.isEmpty()) dumpErrors(errorLog, hideWarnings);
+        if (!rendered) return nullptr;
+        return cache.insert(name, content.str());
+    }
+
+    if (!haveIndexes) {
+        make_indexes(builder.frontTemplate, builder.backTemplate, builder.genTime, builder.document, indexes);
+        haveIndexes = true;
+    }
+    auto index = indexes.pages.find(name);
+    if (index != indexes.pages.end()) return &index->second;
+
+    const ImageAsset *image = findImageAsset(builder.document, name);
+    if (image) {
+        std::ifstream file(image->source, std::ios::binary);
+        if (!file) return nullptr;
+        std::stringstream content;
+        content << file.rdbuf();
+        scratch.content = content.str();
+        scratch.etag = makeETag(scratch.content);
+        return &scratch;
+    }
+
+    const std::string locations[] = { "out/", "templates/" };
+    for (const std::string &location : locations) {
+        std::ifstream file(location + name, std::ios::binary);
+        if (!file) continue;
+        std::stringstream content;
+        content << file.rdbuf();
+        scratch.content = content.str();
+        scratch.etag = makeETag(scratch.content);
+        return &scratch;
+    }
+    return nullptr;
+}
+
+void Server::handle(int client, const std::string &data) {
+    Request request;
+    if (!parseRequest(data, request)) {
+        sendError(client, "400 Bad Request");
+        return;
+    }
+    if (request.method != "GET" && request.method != "HEAD") {
+        sendError(client, "405 Method Not Allowed");
+        return;
+    }
+    std::string name;
+    if (!targetToName(request.path, name)) {
+        sendError(client, "400 Bad Request");
+        return;
+    }
+
+    CachedPage scratch;
+    const CachedPage *page = findPage(name, scratch);
+    if (!page) {
+        sendError(client, "404 Not Found");
+        return;
+    }
+
+    // image copies are named after their content, so they never change
+    const bool immutable = name.compare(0, 7, "assets/") == 0;
+    std::string headers = "ETag: " + page->etag + "\r\nCache-Control: ";
+    headers += immutable ? "public, max-age=31536000, immutable\r\n" : "no-cache\r\n";
+    auto ifNoneMatch = request.headers.find("if-none-match");
+    if (ifNoneMatch != request.headers.end() && etagMatches(ifNoneMatch->second, page->etag)) {
+        sendResponse(client, "304 Not Modified", headers, "", false);
+        return;
+    }
+    headers += "Content-Type: " + contentType(name) + "\r\n";
+    sendResponse(client, "200 OK", headers, page->content, request.method == "GET");
+}
+
+// Scan the project and serve its pages over HTTP on the local machine,
+// rendering each page only when it is first asked for.
+int serveProject(Builder &builder, unsigned short port) {
+    ErrorLog errorLog;
+    bool scanned = builder.scan(errorLog);
+    if (scanned) {
+        prepareImages(builder.document, builder.havePrevious ? &builder.previous : nullptr, false, errorLog);
+        scanned = !errorLog.hasErrors();
+    }
+    if (!errorLog.isEmpty()) dumpErrors(errorLog, hideWarnings);
+    if (!scanned) return 1;
+
+    Server server(builder);
+    if (!server.listen(port)) {
+        std::cerr << "Failed to listen on port " << port << ": " << std::strerror(errno) << ".\n";
+        return 1;
+    }
+    std::cerr << "Serving on http://localhost:" << port << "/\n";
+
+    // Pages are rendered on this thread one request at a time, but requests
+    // are read from every client at once, so one that is slow to send its
+    // request does not hold up the others.
+    std::vector<Connection> pending;
+    while (true) {
+        std::vector<pollfd> fds(pending.size() + 1);
+        fds[0].fd = server.fd;
+        fds[0].events = POLLIN;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int timeout = -1;
+        for (unsigned i = 0; i < pending.size(); ++i) {
+            fds[i + 1].fd = pending[i].fd;
+            fds[i + 1].events = POLLIN;
+            long long left = std::chrono::duration_cast<std::chrono::milliseconds>(pending[i].deadline - now).count();
+            if (left < 0) left = 0;
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Failed to wait for connections: " << std::strerror(errno) << ".\n";
+            return 1;
+        }
+
+        now = std::chrono::steady_clock::now();
+        std::vector<Connection> waiting;
+        for (unsigned i = 0; i < pending.size(); ++i) {
+            Connection &connection = pending[i];
+            bool finished = false;
+            if (fds[i + 1].revents != 0) {
+                char buffer[4096];
+                ssize_t count = recv(connection.fd, buffer, sizeof(buffer), 0);
+                if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+                    // nothing to read after all
+                } else if (count <= 0) {
+                    finished = true;
+                } else {
+                    connection.data.append(buffer, count);
+                    if (connection.data.find("\r\n\r\n") != std::string::npos) {
+                        server.handle(connection.fd, connection.data);
+                        finished = true;
+                    } else if (connection.data.size() > maxRequestSize) {
+                        sendError(connection.fd, "400 Bad Request");
+                        finished = true;
+                    }
+                }
+            }
+            if (!finished && now >= connection.deadline) {
+                sendError(connection.fd, "408 Request Timeout");
+                finished = true;
+            }
+            if (finished) {
+                close(connection.fd);
+            } else {
+                waiting.push_back(std::move(connection));
+            }
+        }
+        pending.swap(waiting);
+
+        if (fds[0].revents == 0) continue;
+        int client = accept4(server.fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "Failed to accept connection: " << std::strerror(errno) << ".\n";
+            return 1;
+        }
+        // responses are sent whole, so a client that stops reading one
+        // would block the server; give up on it after the same time
+        timeval limit;
+        limit.tv_sec = requestTimeout.count();
+        limit.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+        pending.push_back(Connection(client, now + requestTimeout));
+    }
+}
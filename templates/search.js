@@ -0,0 +1,163 @@
+// Searches the index the build writes to search/. Only the index description
+// and the shards holding the words of a query are fetched, so the size of the
+// wiki makes little difference to a search.
+(function () {
+    'use strict';
+
+    var box = document.getElementById('search_box');
+    var results = document.getElementById('search_results');
+    if (!box || !results || !window.fetch || !window.TextEncoder) return;
+
+    var maxResults = 20;
+    var encoder = new TextEncoder();
+    var index = null;
+    var files = {};
+
+    function fetchJson(name) {
+        if (!files[name]) {
+            files[name] = fetch('search/' + name).then(function (response) {
+                return response.ok ? response.json() : null;
+            }).catch(function () {
+                return null;
+            });
+        }
+        return files[name];
+    }
+
+    // Split text into terms as the build does: runs of letters, digits and
+    // non-ASCII characters, with ASCII letters in lower case and lengths
+    // counted in UTF-8 bytes.
+    function termsOf(text) {
+        var words = text.match(/[A-Za-z0-9\u0080-\uffff]+/g) || [];
+        var terms = [];
+        words.forEach(function (word) {
+            var term = word.replace(/[A-Z]/g, function (c) { return c.toLowerCase(); });
+            var length = encoder.encode(term).length;
+            if (length < index.minTermLength || length > index.maxTermLength) return;
+            if (index.stopWords.indexOf(term) >= 0) return;
+            terms.push(term);
+        });
+        return terms;
+    }
+
+    function shardName(term) {
+        var bytes = encoder.encode(term);
+        var name = 'terms-';
+        for (var i = 0; i < 2; ++i) {
+            var c = bytes[i];
+            if ((c >= 0x61 && c <= 0x7a) || (c >= 0x30 && c <= 0x39)) {
+                name += String.fromCharCode(c);
+            } else {
+                name += '_' + (c < 16 ? '0' : '') + c.toString(16);
+            }
+        }
+        return name + '.json';
+    }
+
+    // The best weight and anchor of each article for one term. The last term
+    // of a query still being typed also matches the terms it starts.
+    function postingsFor(term, isPrefix) {
+        return fetchJson(shardName(term)).then(function (shard) {
+            var found = {};
+            if (!shard) return found;
+            Object.keys(shard).forEach(function (key) {
+                if (key !== term && !(isPrefix && key.lastIndexOf(term, 0) === 0)) return;
+                shard[key].forEach(function (posting) {
+                    var doc = posting[0], best = found[doc];
+                    if (!best) {
+                        found[doc] = best = { weight: 0, anchorWeight: 0, anchor: '' };
+                    }
+                    best.weight += posting[1];
+                    if (posting[1] > best.anchorWeight) {
+                        best.anchorWeight = posting[1];
+                        best.anchor = posting[2] || '';
+                    }
+                });
+            });
+            return found;
+        });
+    }
+
+    function escapeHtml(text) {
+        return text.replace(/[&<>"']/g, function (c) {
+            return '&#' + c.charCodeAt(0) + ';';
+        });
+    }
+
+    function show(matches) {
+        var shardsNeeded = {};
+        matches.forEach(function (match) {
+            shardsNeeded[Math.floor(match.doc / index.docsPerShard)] = true;
+        });
+        var loads = Object.keys(shardsNeeded).map(function (shard) {
+            return fetchJson('docs-' + shard + '.json').then(function (docs) {
+                return { shard: shard, docs: docs };
+            });
+        });
+        return Promise.all(loads).then(function (loaded) {
+            var docs = {};
+            loaded.forEach(function (entry) {
+                docs[entry.shard] = entry.docs || [];
+            });
+            var html = '';
+            matches.forEach(function (match) {
+                var doc = docs[Math.floor(match.doc / index.docsPerShard)][match.doc % index.docsPerShard];
+                if (!doc) return;
+                var href = doc[0] + (match.anchor ? '#' + encodeURIComponent(match.anchor) : '');
+                html += "<li><a href='" + escapeHtml(href) + "'>" + escapeHtml(doc[1] || doc[0]) + '</a></li>';
+            });
+            results.innerHTML = html ? '<ul>' + html + '</ul>' : matches.length ? '' : '<p>No pages found.</p>';
+        });
+    }
+
+    var pending = 0;
+    function search() {
+        var query = box.value;
+        var serial = ++pending;
+        if (!query.trim()) {
+            results.innerHTML = '';
+            return;
+        }
+        fetchJson('index.json').then(function (loaded) {
+            index = loaded;
+            if (!index || serial !== pending) return null;
+            var terms = termsOf(query);
+            if (!terms.length) return null;
+            var typing = !/\s$/.test(query);
+            return Promise.all(terms.map(function (term, i) {
+                return postingsFor(term, typing && i === terms.length - 1);
+            }));
+        }).then(function (found) {
+            if (!found || serial !== pending) return;
+            // pages must contain every term of the query
+            var matches = [];
+            Object.keys(found[0]).forEach(function (doc) {
+                var weight = 0, anchor = found[0][doc].anchor, anchorWeight = 0;
+                for (var i = 0; i < found.length; ++i) {
+                    var posting = found[i][doc];
+                    if (!posting) return;
+                    weight += posting.weight;
+                    if (posting.anchorWeight > anchorWeight) {
+                        anchorWeight = posting.anchorWeight;
+                        anchor = posting.anchor;
+                    }
+                }
+                matches.push({ doc: Number(doc), weight: weight, anchor: anchor });
+            });
+            matches.sort(function (left, right) {
+                return right.weight - left.weight || left.doc - right.doc;
+            });
+            return show(matches.slice(0, maxResults));
+        });
+    }
+
+    var timer = null;
+    box.addEventListener('input', function () {
+        clearTimeout(timer);
+        timer = setTimeout(search, 150);
+    });
+    box.form && box.form.addEventListener('submit', function (event) {
+        event.preventDefault();
+        search();
+    });
+})();
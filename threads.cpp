@@ -0,0 +1,79 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "latexwiki.h"
+
+unsigned jobCount = 1;
+
+// Run work(i) for every i in [0, count) across a pool of worker threads while
+// the calling thread runs consume(i) strictly in index order as soon as each
+// item (and every item before it) has finished. This lets the expensive,
+// independent part of a phase run in parallel while anything order-dependent
+// still sees exactly the sequence a serial loop would.
+void runOrdered(unsigned count, unsigned jobs,
+                const std::function<void(unsigned)> &work,
+                const std::function<void(unsigned)> &consume) {
+    if (jobs <= 1 || count <= 1) {
+        for (unsigned i = 0; i < count; ++i) {
+            work(i);
+            consume(i);
+        }
+        return;
+    }
+
+    std::atomic<unsigned> next(0);
+    std::mutex lock;
+    std::condition_variable ready;
+    std::vector<bool> done(count, false);
+
+    std::vector<std::thread> workers;
+    if (jobs > count) jobs = count;
+    for (unsigned t = 0; t < jobs; ++t) {
+        workers.push_back(std::thread([&]() {
+            while (true) {
+                unsigned i = next++;
+                if (i >= count) return;
+                work(i);
+                std::lock_guard<std::mutex> guard(lock);
+                done[i] = true;
+                ready.notify_all();
+            }
+        }));
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [&]() { return done[i]; });
+        }
+        consume(i);
+    }
+
+    for (std::thread &worker : workers) worker.join();
+}
+
+// Run work(i) for every i in [0, count) across a pool of worker threads, in no
+// particular order, and return once all of them have finished.
+void runParallel(unsigned count, unsigned jobs, const std::function<void(unsigned)> &work) {
+    if (jobs <= 1 || count <= 1) {
+        for (unsigned i = 0; i < count; ++i) work(i);
+        return;
+    }
+
+    std::atomic<unsigned> next(0);
+    std::vector<std::thread> workers;
+    if (jobs > count) jobs = count;
+    for (unsigned t = 0; t < jobs; ++t) {
+        workers.push_back(std::thread([&]() {
+            while (true) {
+                unsigned i = next++;
+                if (i >= count) return;
+                work(i);
+            }
+        }));
+    }
+    for (std::thread &worker : workers) worker.join();
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "latexwiki.h"
+
+bool tracing = false;
+
+static const std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+
+struct TraceEvent {
+    const char *category;
+    const char *name;
+    std::string detail;
+    long long start, duration;
+    unsigned thread;
+};
+
+struct CommandStat {
+    long long time;
+    unsigned long count;
+};
+
+// Spans are recorded into a buffer belonging to the thread that ran them, so
+// worker threads never wait on each other. When a worker exits its buffer is
+// handed over to the finished list.
+struct ThreadTrace {
+    ThreadTrace();
+    ~ThreadTrace();
+    void moveTo(std::vector<TraceEvent> &allEvents, CommandStat *allCommands);
+
+    unsigned thread;
+    std::vector<TraceEvent> events;
+    CommandStat commands[static_cast<unsigned>(CommandId::Count)];
+    CommandTimer *currentCommand;
+};
+
+static std::mutex finishedLock;
+static std::vector<TraceEvent> finishedEvents;
+static CommandStat finishedCommands[static_cast<unsigned>(CommandId::Count)];
+static std::atomic<unsigned> nextThread(1);
+static thread_local ThreadTrace threadTrace;
+
+ThreadTrace::ThreadTrace()
+: thread(nextThread++), currentCommand(nullptr)
+{
+    for (CommandStat &stat : commands) stat = CommandStat{0, 0};
+}
+
+ThreadTrace::~ThreadTrace() {
+    std::lock_guard<std::mutex> guard(finishedLock);
+    moveTo(finishedEvents, finishedCommands);
+}
+
+void ThreadTrace::moveTo(std::vector<TraceEvent> &allEvents, CommandStat *allCommands) {
+    allEvents.insert(allEvents.end(), std::make_move_iterator(events.begin()), std::make_move_iterator(events.end()));
+    events.clear();
+    for (unsigned i = 0; i < static_cast<unsigned>(CommandId::Count); ++i) {
+        allCommands[i].time += commands[i].time;
+        allCommands[i].count += commands[i].count;
+        commands[i] = CommandStat{0, 0};
+    }
+}
+
+long long traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+void TraceSpan::record() {
+    long long end = traceNow();
+    threadTrace.events.push_back(TraceEvent{category, name, detail ? *detail : std::string(), start, end - start, threadTrace.thread});
+}
+
+// Command timers nest the way the commands do, so each one takes the time
+// spent in the commands inside it off its own.
+void CommandTimer::enter() {
+    parent = threadTrace.currentCommand;
+    threadTrace.currentCommand = this;
+}
+
+void CommandTimer::leave() {
+    long long elapsed = traceNow() - start;
+    CommandStat &stat = threadTrace.commands[static_cast<unsigned>(id)];
+    stat.time += elapsed - childTime;
+    ++stat.count;
+    if (parent) parent->childTime += elapsed;
+    threadTrace.currentCommand = parent;
+}
+
+// Gather everything recorded so far. Only the calling thread may still be
+// running spans.
+static void collectTrace(std::vector<TraceEvent> &events, CommandStat *commands) {
+    std::lock_guard<std::mutex> guard(finishedLock);
+    threadTrace.moveTo(finishedEvents, finishedCommands);
+    events.swap(finishedEvents);
+    for (unsigned i = 0; i < static_cast<unsigned>(CommandId::Count); ++i) {
+        commands[i] = finishedCommands[i];
+        finishedCommands[i] = CommandStat{0, 0};
+    }
+}
+
+static void writeTraceFile(const std::string &filename, const std::vector<TraceEvent> &events) {
+    std::ofstream out(filename);
+    if (!out) {
+        std::cerr << "Failed to write trace file " << filename << "\n";
+        return;
+    }
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (unsigned i = 0; i < events.size(); ++i) {
+        const TraceEvent &event = events[i];
+        char times[64];
+        std::snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", event.start / 1000.0, event.duration / 1000.0);
+        out << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\",";
+        out << times << ",\"pid\":1,\"tid\":" << event.thread;
+        if (!event.detail.empty()) out << ",\"args\":{\"detail\":\"" << escapeJson(event.detail) << "\"}";
+        out << (i + 1 < events.size() ? "},\n" : "}\n");
+    }
+    out << "]}\n";
+    if (!out) std::cerr << "Failed to write trace file " << filename << "\n";
+}
+
+static void printTime(long long nanoseconds) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%10.3f ms  ", nanoseconds / 1000000.0);
+    std::cerr << text;
+}
+
+static void printStats(const std::vector<TraceEvent> &events, const CommandStat *commands, unsigned count) {
+    std::map<std::string, long long> articleTimes;
+    for (const TraceEvent &event : events) {
+        if (event.category == std::string("article")) articleTimes[event.detail] += event.duration;
+    }
+    std::vector<std::pair<long long, std::string>> articles;
+    for (const auto &iter : articleTimes) articles.push_back(std::make_pair(iter.second, iter.first));
+    std::sort(articles.begin(), articles.end(), [](const std::pair<long long, std::string> &left, const std::pair<long long, std::string> &right) {
+        return left.first > right.first;
+    });
+    std::cerr << "Slowest articles (parse, scan and render):\n";
+    for (unsigned i = 0; i < articles.size() && i < count; ++i) {
+        printTime(articles[i].first);
+        std::cerr << articles[i].second << "\n";
+    }
+
+    std::vector<unsigned> ids;
+    for (unsigned i = 0; i < static_cast<unsigned>(CommandId::Count); ++i) {
+        if (commands[i].count > 0) ids.push_back(i);
+    }
+    std::sort(ids.begin(), ids.end(), [&](unsigned left, unsigned right) {
+        return commands[left].time > commands[right].time;
+    });
+    std::cerr << "Render time by command (excluding nested commands):\n";
+    for (unsigned id : ids) {
+        const char *name = getCommandInfo(static_cast<CommandId>(id)).name;
+        printTime(commands[id].time);
+        std::cerr << (name[0] ? name : "(unknown)") << " x" << commands[id].count << "\n";
+    }
+    std::cerr << "\n";
+}
+
+// Write and report whatever was traced since the last call, then start
+// afresh.
+void finishTrace(const std::string &filename, bool showStats, unsigned statsCount) {
+    std::vector<TraceEvent> events;
+    CommandStat commands[static_cast<unsigned>(CommandId::Count)];
+    collectTrace(events, commands);
+    if (!filename.empty()) writeTraceFile(filename, events);
+    if (showStats) printStats(events, commands, statsCount);
+}
@@ -1,6 +1,9 @@
+#include <cstdio>
 #include <fstream>
 #include <string>
 
+#include "latexwiki.h"
+
 static const char *whitespaceChars = " \t\n\r";
 
 int g_toupper(int c) {
@@ -12,7 +15,34 @@ bool is_identifier(char c) {
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
 }
 
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Copy text, replacing each run of whitespace that spans a line break with a
+// single space, as if the lines had been trimmed and joined.
+std::string collapseLines(StringView text) {
+    std::string result;
+    result.reserve(text.size);
+    for (std::size_t pos = 0; pos < text.size; ) {
+        if (!is_space(text.data[pos])) {
+            result += text.data[pos++];
+            continue;
+        }
+        std::size_t start = pos;
+        bool lineBreak = false;
+        while (pos < text.size && is_space(text.data[pos])) {
+            if (text.data[pos] == '\n') lineBreak = true;
+            ++pos;
+        }
+        if (lineBreak) result += ' ';
+        else result.append(text.data + start, pos - start);
+    }
+    return result;
+}
+
 std::string readFile(const std::string &filename) {
+    TraceSpan span("io", "read", filename);
     std::ifstream inf(filename);
     if (!inf) return "";
     std::string text, line;
@@ -40,3 +70,42 @@ std::string& replaceText(std::string &text, const std::string &from, const std::
         text.replace(titlePos, from.size(), to);
     }
 }
+
+unsigned long long hashBytes(const char *data, std::size_t size, unsigned long long hash) {
+    for (std::size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+unsigned long long hashText(const std::string &text, unsigned long long hash) {
+    return hashBytes(text.data(), text.size(), hash);
+}
+
+// Escape text for use inside a JSON string.
+std::string escapeJson(const std::string &text) {
+    std::string result;
+    for (char c : text) {
+        switch (c) {
+            case '"':   result += "\\\""; break;
+            case '\\':  result += "\\\\"; break;
+            case '\n':  result += "\\n"; break;
+            case '\t':  result += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char code[8];
+                    std::snprintf(code, sizeof(code), "\\u%04x", c);
+                    result += code;
+                } else {
+                    result += c;
+                }
+        }
+    }
+    return result;
+}
+
+bool fileExists(const std::string &filename) {
+    std::ifstream inf(filename);
+    return inf.good();
+}
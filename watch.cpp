@@ -0,0 +1,171 @@
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "latexwiki.h"
+
+// How long to wait for more events after the first one, so a save that
+// touches several files (or an editor's write-and-rename) causes one rebuild.
+static const int settleTime = 10;
+// How long to wait after a rebuild before saving the manifest, so a burst of
+// saves does not write it after each one.
+static const int idleTime = 1000;
+
+static std::string directoryOf(const std::string &path) {
+    std::string::size_type slash = path.find_last_of('/');
+    if (slash == std::string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+static std::string normalizePath(const std::string &path) {
+    std::string result = path;
+    while (result.compare(0, 2, "./") == 0) result.erase(0, 2);
+    return result;
+}
+
+struct Watcher {
+    Watcher(Builder &builder);
+    ~Watcher();
+    bool addWatches();
+    bool waitForChanges();
+
+    Builder &builder;
+    int fd;
+    // reports SIGINT and SIGTERM, which stop watching once the manifest is
+    // saved
+    int signals;
+    std::map<int, std::string> directories;
+    std::map<std::string, std::string> sourcePaths;
+    bool projectChanged, templatesChanged;
+    std::set<std::string> changedSources;
+};
+
+Watcher::Watcher(Builder &builder)
+: builder(builder), fd(inotify_init1(IN_CLOEXEC)), signals(-1), projectChanged(false), templatesChanged(false)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) == 0) signals = signalfd(-1, &mask, SFD_CLOEXEC);
+}
+
+Watcher::~Watcher() {
+    if (fd >= 0) close(fd);
+    if (signals >= 0) close(signals);
+}
+
+// Watch the directories holding the project file, the templates and every
+// source. Directories are watched instead of the files themselves so that
+// editors which save by writing a new file and renaming it are still seen.
+bool Watcher::addWatches() {
+    std::set<std::string> wanted;
+    wanted.insert(directoryOf(builder.filelist));
+    wanted.insert("templates");
+    sourcePaths.clear();
+    for (const std::string &source : builder.sources) {
+        wanted.insert(directoryOf(source));
+        sourcePaths[normalizePath(source)] = source;
+    }
+
+    const unsigned mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+    for (const std::string &directory : wanted) {
+        int wd = inotify_add_watch(fd, directory.c_str(), mask);
+        if (wd < 0) {
+            std::cerr << "Failed to watch directory " << directory << ".\n";
+            return false;
+        }
+        directories[wd] = directory;
+    }
+    return true;
+}
+
+// Block until something the project depends on changes, then sort the
+// changes into the project file, the templates and individual sources. The
+// manifest is saved if nothing changes for a while. Returns false once told
+// to stop.
+bool Watcher::waitForChanges() {
+    projectChanged = templatesChanged = false;
+    changedSources.clear();
+    const std::string filelist = normalizePath(builder.filelist);
+
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int timeout = builder.manifestPending ? idleTime : -1;
+    while (true) {
+        pollfd pfds[2] = { { fd, POLLIN, 0 }, { signals, POLLIN, 0 } };
+        int ready = poll(pfds, signals >= 0 ? 2 : 1, timeout);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0 || (signals >= 0 && pfds[1].revents)) return false;
+        if (ready == 0) {
+            if (projectChanged || templatesChanged || !changedSources.empty()) return true;
+            if (timeout == idleTime) builder.saveManifest();
+            timeout = builder.manifestPending ? idleTime : -1;
+            continue;
+        }
+
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0) return false;
+        for (char *pos = buffer; pos < buffer + length; ) {
+            const inotify_event *event = reinterpret_cast<const inotify_event*>(pos);
+            pos += sizeof(inotify_event) + event->len;
+            if (event->len == 0) continue;
+
+            auto directory = directories.find(event->wd);
+            if (directory == directories.end()) continue;
+            const std::string path = normalizePath(directory->second + "/" + event->name);
+            if (path == filelist) {
+                projectChanged = true;
+            } else if (directory->second == "templates") {
+                templatesChanged = true;
+            } else {
+                auto source = sourcePaths.find(path);
+                if (source != sourcePaths.end()) changedSources.insert(source->second);
+            }
+        }
+        timeout = settleTime;
+    }
+}
+
+// Keep the project loaded and rebuild whatever a change to one of its files
+// affects, until interrupted.
+int watchProject(Builder &builder) {
+    Watcher watcher(builder);
+    if (watcher.fd < 0) {
+        std::cerr << "Failed to start watching for changes.\n";
+        return 1;
+    }
+    if (!watcher.addWatches()) return 1;
+
+    std::cerr << "Watching for changes...\n";
+    while (watcher.waitForChanges()) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (watcher.projectChanged) {
+            if (!builder.loadProject()) continue;
+            watcher.addWatches();
+            // files may have been added or reordered, so check them all
+            builder.changesKnown = false;
+        } else {
+            builder.changesKnown = true;
+        }
+        if (watcher.templatesChanged) builder.loadTemplates();
+        builder.changedSources.insert(watcher.changedSources.begin(), watcher.changedSources.end());
+
+        builder.build();
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        std::cerr << "Rebuilt in " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms.\n";
+        std::cerr << "Watching for changes...\n";
+    }
+    if (builder.manifestPending) builder.saveManifest();
+    std::cerr << "Stopped watching for changes.\n";
+    return 1;
+}